@@ -2,8 +2,23 @@
 // File:	datastore.h
 // Purpose: Provide common interface for datastore and backing services
 //==============================================================================
+#pragma once
+
+#include <time.h>
+
 namespace Datastore
 {
+  //------------------------------------------------------------------------------
+  // GetTime - monotonic clock in milliseconds, for timing work done on the event loop
+  //------------------------------------------------------------------------------
+  inline double GetTime()
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+  }
+
   //------------------------------------------------------------------------------
   // Exception
   //------------------------------------------------------------------------------
@@ -92,10 +107,16 @@ namespace Datastore
 	 public:
 		Provider(Module* _pOwner, const Anope::string& _name) : Service(_pOwner, "Datastore::Provider", _name) { }
 
-    virtual void Create(Serializable* _pObject) = 0;
+    virtual uint64_t AllocateId(Serialize::Type* _pType) = 0;
+    // Changes whenever ids handed out by AllocateId stop being valid, e.g. after moving to another server
+    virtual unsigned long GetIdGeneration() const = 0;
+    virtual bool Create(Serializable* _pObject) = 0;
+    virtual void Create(const std::vector<Serializable*>& _objects, std::vector<Serializable*>& _failed) = 0;
     virtual void Read(Serialize::Type* _pType) = 0;
     virtual void Update(Serializable* _pObject) = 0;
+    virtual void Update(const std::vector<Serializable*>& _objects, std::vector<Serializable*>& _failed) = 0;
     virtual void Destroy(Serializable* _pObject) = 0;
+    virtual void Destroy(const Anope::string& _table, const std::vector<uint64_t>& _ids) = 0;
 	};
 
 }
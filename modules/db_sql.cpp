@@ -1,9 +1,227 @@
+/* RequiredLibraries: rt */
 //==============================================================================
 // File:	db_sql.cpp
 // Purpose: Provide bi-directional commication based on sql store
 //==============================================================================
 #include "db_sql.h"
 
+//------------------------------------------------------------------------------
+// DBSQLFlushTimer
+//------------------------------------------------------------------------------
+DBSQLFlushTimer::DBSQLFlushTimer(DBSQL* _pModule)
+  : Timer(_pModule, 60, Anope::CurTime, true),
+  m_module(*_pModule)
+{
+
+}
+
+//------------------------------------------------------------------------------
+void DBSQLFlushTimer::Tick(time_t _now) anope_override
+{
+  // Writes left queued after a failure are retried here rather than spinning the loop
+  if (m_module.GetPendingCount(DBSQL::CRITICAL))
+    m_module.OnNotify();
+
+  m_module.FlushDeferred();
+}
+
+//------------------------------------------------------------------------------
+// CommandOSSQLQueue
+//------------------------------------------------------------------------------
+CommandOSSQLQueue::CommandOSSQLQueue(DBSQL* _pModule)
+  : Command(_pModule, "operserv/sqlqueue", 0, 0),
+  m_module(*_pModule)
+{
+  this->SetDesc(_("Show database write queue lag"));
+}
+
+//------------------------------------------------------------------------------
+void CommandOSSQLQueue::Execute(CommandSource& _source, const std::vector<Anope::string>& _params) anope_override
+{
+  static const char* const names[DBSQL::PRIORITY_COUNT] = { "critical", "deferred" };
+
+  for (int i = 0; i < DBSQL::PRIORITY_COUNT; ++i)
+  {
+    DBSQL::EPRIORITY ePriority = static_cast<DBSQL::EPRIORITY>(i);
+    const DBSQL::QueueStatistics& statistics = m_module.GetQueueStatistics(ePriority);
+
+    _source.Reply(Anope::printf("%-8s pending=%lu writes=%lu lag=%.1fms max=%.1fms", names[i], static_cast<unsigned long>(m_module.GetPendingCount(ePriority)), statistics.writes, statistics.lastLag, statistics.maxLag));
+  }
+}
+
+//------------------------------------------------------------------------------
+bool CommandOSSQLQueue::OnHelp(CommandSource& _source, const Anope::string& _subcommand) anope_override
+{
+  this->SendSyntax(_source);
+  _source.Reply(" ");
+  _source.Reply(_("Shows how many writes are waiting in each database queue, how\n"
+                  "many have been written, and how long the most recent and the\n"
+                  "slowest write waited before reaching the database.\n"
+                  " \n"
+                  "Critical changes are written immediately; updates touching only\n"
+                  "fields listed in a db_sql \002defer\002 block are written on the\n"
+                  "flush interval."));
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// DBSQL
+//------------------------------------------------------------------------------
+void DBSQL::QueueChange(Serializable* _pObject, EACTION _eAction)
+{
+  Change change;
+  change.eAction = _eAction;
+  change.queuedAt = Datastore::GetTime();
+  change.idGeneration = m_hDatabaseConnection->GetIdGeneration();
+  change.attempts = 0;
+  change.retryAt = 0;
+
+  // A pending change keeps its action and queue time; the row is written whole either way
+  m_changeList.insert(std::make_pair(_pObject, change));
+  Notify();
+}
+
+//------------------------------------------------------------------------------
+void DBSQL::ReleaseId(Serializable* _pObject)
+{
+  // The object is unregistered until its insert succeeds and the database assigns an id
+  if (_pObject->id == 0)
+    return;
+
+  _pObject->GetSerializableType()->objects.erase(_pObject->id);
+  _pObject->id = 0;
+}
+
+//------------------------------------------------------------------------------
+void DBSQL::RecordLag(EPRIORITY _ePriority, double _lag)
+{
+  QueueStatistics& statistics = m_queueStatistics[_ePriority];
+
+  statistics.writes++;
+  statistics.lastLag = _lag;
+  if (_lag > statistics.maxLag)
+    statistics.maxLag = _lag;
+}
+
+//------------------------------------------------------------------------------
+const std::set<Anope::string>* DBSQL::GetDeferredFields(Serializable* _pObject) const
+{
+  std::map<Anope::string, std::set<Anope::string> >::const_iterator itFields = m_deferredFields.find(_pObject->GetSerializableType()->GetName());
+  if (itFields == m_deferredFields.end())
+    return NULL;
+
+  return &itFields->second;
+}
+
+//------------------------------------------------------------------------------
+uint64_t DBSQL::GetCriticalDigest(Serializable* _pObject, const std::set<Anope::string>& _deferredFields) const
+{
+  Datastore::Data serialized_data;
+  _pObject->Serialize(serialized_data);
+
+  // 64-bit FNV-1a over each name and value, both NUL terminated so field boundaries can not shift
+  uint64_t digest = 14695981039346656037ULL;
+  for (Datastore::Data::Map::const_iterator it = serialized_data.data.begin(), it_end = serialized_data.data.end(); it != it_end; ++it)
+  {
+    if (_deferredFields.find(it->first) != _deferredFields.end())
+      continue;
+
+    const Anope::string value = it->second->str();
+    const Anope::string* parts[] = { &it->first, &value };
+    for (int i = 0; i < 2; ++i)
+    {
+      const char* pBuffer = parts[i]->c_str();
+      for (size_t j = 0; j <= parts[i]->length(); ++j)
+      {
+        digest ^= static_cast<unsigned char>(pBuffer[j]);
+        digest *= 1099511628211ULL;
+      }
+    }
+  }
+
+  return digest;
+}
+
+//------------------------------------------------------------------------------
+void DBSQL::UpdateBaseline(Serializable* _pObject)
+{
+  // Remember a digest of the critical fields as last written, so later updates can be compared against it
+  const std::set<Anope::string>* pFields = GetDeferredFields(_pObject);
+  if (!pFields || pFields->empty())
+    return;
+
+  m_criticalDigests[_pObject] = GetCriticalDigest(_pObject, *pFields);
+}
+
+//------------------------------------------------------------------------------
+bool DBSQL::isDeferrable(Serializable* _pObject)
+{
+  const std::set<Anope::string>* pFields = GetDeferredFields(_pObject);
+  if (!pFields)
+    return false;
+
+  // No field list defers every update of the type
+  if (pFields->empty())
+    return true;
+
+  // Without a baseline the change can not be classified, so it is written as critical
+  std::map<Serializable*, uint64_t>::const_iterator itBaseline = m_criticalDigests.find(_pObject);
+  if (itBaseline == m_criticalDigests.end())
+    return false;
+
+  return GetCriticalDigest(_pObject, *pFields) == itBaseline->second;
+}
+
+//------------------------------------------------------------------------------
+void DBSQL::FlushDeferred()
+{
+  if (m_deferredList.empty() || !this->isConnectionReady())
+    return;
+
+  Log(LOG_DEBUG) << "DBSQL::FlushDeferred - " << stringify(m_deferredList.size());
+
+  std::vector<Serializable*> updates;
+  for (std::map<Serializable*, double>::iterator it = m_deferredList.begin(); it != m_deferredList.end(); ++it)
+  {
+    // Rows are written whole, so a pending critical write already carries the newest values
+    if (m_changeList.find(it->first) == m_changeList.end())
+      updates.push_back(it->first);
+  }
+
+  // The provider writes the rows set-based, one statement per type instead of one per row
+  std::vector<Serializable*> failed;
+  if (!updates.empty())
+    m_hDatabaseConnection->Update(updates, failed);
+
+  double now = Datastore::GetTime();
+  std::set<Serializable*> failedSet(failed.begin(), failed.end());
+  std::map<Serializable*, double> retryList;
+  for (std::vector<Serializable*>::iterator it = updates.begin(); it != updates.end(); ++it)
+  {
+    Serializable* pObject = *it;
+    if (failedSet.count(pObject))
+    {
+      retryList[pObject] = m_deferredList[pObject];
+      continue;
+    }
+
+    pObject->UpdateTS();
+    UpdateBaseline(pObject);
+    RecordLag(DEFERRED, now - m_deferredList[pObject]);
+  }
+
+  if (!retryList.empty())
+    Log(LOG_NORMAL, "db_sql") << "DBSQL: " << stringify(retryList.size()) << " deferred updates failed, retrying on the next flush";
+
+  m_deferredList.swap(retryList);
+}
+
+//------------------------------------------------------------------------------
+size_t DBSQL::GetPendingCount(EPRIORITY _ePriority) const
+{
+  return _ePriority == CRITICAL ? m_changeList.size() : m_deferredList.size();
+}
+
 //------------------------------------------------------------------------------
 bool DBSQL::isConnectionReady()
 {
@@ -30,8 +248,17 @@ bool DBSQL::isConnectionReady()
 DBSQL::DBSQL(const Anope::string& _modname, const Anope::string& _creator)
   : Module(_modname, _creator, DATABASE | VENDOR),
   m_hDatabaseConnection("", ""),
-  m_isDatabaseLoaded(false)
+  m_isDatabaseLoaded(false),
+  m_flushTimer(this),
+  m_commandOSSQLQueue(this)
 {
+  for (int i = 0; i < PRIORITY_COUNT; ++i)
+  {
+    m_queueStatistics[i].writes = 0;
+    m_queueStatistics[i].lastLag = 0;
+    m_queueStatistics[i].maxLag = 0;
+  }
+
   if (ModuleManager::FindFirstOf(DATABASE) != this)
     throw ModuleException("If db_sql is loaded it must be the first database module loaded.");
 }
@@ -44,27 +271,93 @@ void DBSQL::OnNotify() anope_override
   
   Log(LOG_DEBUG) << "DBSQL::OnNotify";
 
-  for (std::map<Serializable*, EACTION>::iterator it = m_changeList.begin(); it != m_changeList.end(); ++it)
+  std::vector<Serializable*> creates;
+  std::map<Serializable*, Change> retryList;
+  double now = Datastore::GetTime();
+  unsigned long idGeneration = m_hDatabaseConnection->GetIdGeneration();
+  for (std::map<Serializable*, Change>::iterator it = m_changeList.begin(); it != m_changeList.end(); ++it)
   {
     Serializable* _pObject = it->first;
-    EACTION eAction = it->second;
+    EACTION eAction = it->second.eAction;
     
     switch(eAction)
     {
     case CREATE:
-      m_hDatabaseConnection->Create(_pObject);
-      _pObject->GetSerializableType()->objects[_pObject->id] = _pObject;
-      break;
+      // Inserts that failed before wait out their backoff
+      if (it->second.retryAt > Anope::CurTime)
+      {
+        retryList.insert(*it);
+        continue;
+      }
+
+      // Ids preallocated before the provider moved to another server are dropped, the insert then uses RETURNING
+      if (it->second.idGeneration != idGeneration)
+      {
+        ReleaseId(_pObject);
+        it->second.idGeneration = idGeneration;
+      }
+
+      m_deferredList.erase(_pObject);
+      creates.push_back(_pObject);
+      continue;
       
     case UPDATE:
+      m_deferredList.erase(_pObject);
       m_hDatabaseConnection->Update(_pObject);
       break;
     }
     
     _pObject->UpdateTS();
+    UpdateBaseline(_pObject);
+    RecordLag(CRITICAL, now - it->second.queuedAt);
+  }
+
+  // Creates go to the provider together so rows can share a statement
+  std::vector<Serializable*> failed;
+  if (!creates.empty())
+    m_hDatabaseConnection->Create(creates, failed);
+
+  std::set<Serializable*> failedSet(failed.begin(), failed.end());
+  for (std::vector<Serializable*>::iterator it = creates.begin(); it != creates.end(); ++it)
+  {
+    Serializable* _pObject = *it;
+    if (failedSet.count(_pObject))
+      continue;
+
+    _pObject->GetSerializableType()->objects[_pObject->id] = _pObject;
+    _pObject->UpdateTS();
+    UpdateBaseline(_pObject);
+    RecordLag(CRITICAL, now - m_changeList[_pObject].queuedAt);
   }
   
-  m_changeList.clear();
+  // A failed insert stays queued with an exponential backoff, until it has failed too often to expect success
+  const unsigned int maxAttempts = 5;
+  size_t abandoned = 0;
+  for (std::set<Serializable*>::iterator it = failedSet.begin(); it != failedSet.end(); ++it)
+  {
+    Change& change = m_changeList[*it];
+    if (++change.attempts >= maxAttempts)
+    {
+      // Without an id the next change to the object queues a fresh insert
+      ReleaseId(*it);
+      ++abandoned;
+      continue;
+    }
+
+    change.retryAt = Anope::CurTime + (1 << change.attempts);
+    retryList[*it] = change;
+  }
+
+  if (abandoned)
+    Log(LOG_NORMAL, "db_sql") << "DBSQL: giving up on " << stringify(abandoned) << " inserts after " << stringify(maxAttempts) << " attempts";
+
+  m_changeList.swap(retryList);
+
+  // Destroyed objects are deleted in one statement per type rather than one per row
+  for (std::map<Anope::string, std::vector<uint64_t> >::iterator it = m_destroyList.begin(); it != m_destroyList.end(); ++it)
+    m_hDatabaseConnection->Destroy(it->first, it->second);
+
+  m_destroyList.clear();
 
 //     if (pObject->IsCached(data))
 //       continue;
@@ -82,12 +375,16 @@ EventReturn DBSQL::OnLoadDatabase() anope_override
 //------------------------------------------------------------------------------
 void DBSQL::OnShutdown() anope_override
 {
+  OnNotify();
+  FlushDeferred();
   m_isDatabaseLoaded = false;
 }
 
 //------------------------------------------------------------------------------
 void DBSQL::OnRestart() anope_override
 {
+  OnNotify();
+  FlushDeferred();
   m_isDatabaseLoaded = false;
 }
 
@@ -95,7 +392,32 @@ void DBSQL::OnRestart() anope_override
 void DBSQL::OnReload(Configuration::Conf* _pConfig) anope_override
 {
   Configuration::Block* pBlock = _pConfig->GetModule(this);
-  m_hDatabaseConnection = ServiceReference<Datastore::Provider>("Datastore::Provider", pBlock->Get<const Anope::string>("engine"));
+  const Anope::string& engine = pBlock->Get<const Anope::string>("engine");
+
+  // Ids preallocated by another provider mean nothing to the new one
+  if (engine != m_engine)
+  {
+    for (std::map<Serializable*, Change>::iterator it = m_changeList.begin(); it != m_changeList.end(); ++it)
+      if (it->second.eAction == CREATE)
+        ReleaseId(it->first);
+  }
+
+  m_engine = engine;
+  m_hDatabaseConnection = ServiceReference<Datastore::Provider>("Datastore::Provider", engine);
+
+  m_flushTimer.SetSecs(pBlock->Get<time_t>("deferinterval", "60s"));
+
+  m_deferredFields.clear();
+  for (int i = 0; i < pBlock->CountBlock("defer"); ++i)
+  {
+    Configuration::Block* pDeferBlock = pBlock->GetBlock("defer", i);
+    const Anope::string& type = pDeferBlock->Get<const Anope::string>("type");
+
+    std::set<Anope::string>& fields = m_deferredFields[type];
+    spacesepstream sep(pDeferBlock->Get<const Anope::string>("fields"));
+    for (Anope::string field; sep.GetToken(field);)
+      fields.insert(field);
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -107,8 +429,17 @@ void DBSQL::OnSerializableConstruct(Serializable* _pObject) anope_override
   if(_pObject->id != 0)
     return OnSerializableUpdate(_pObject);
 
-  m_changeList.insert(std::pair<Serializable*, EACTION>(_pObject, CREATE));
-  Notify();
+  // Already waiting for its insert, which will carry the newest values
+  if (m_changeList.find(_pObject) != m_changeList.end())
+    return;
+
+  // With a preallocated id the object is registered now and its insert queued like any other write
+  Serialize::Type* pType = _pObject->GetSerializableType();
+  _pObject->id = m_hDatabaseConnection->AllocateId(pType);
+  if(_pObject->id != 0)
+    pType->objects[_pObject->id] = _pObject;
+
+  QueueChange(_pObject, CREATE);
 }
 
 //------------------------------------------------------------------------------
@@ -119,6 +450,14 @@ void DBSQL::OnSerializeCheck(Serialize::Type* _pType) anope_override
   
   m_hDatabaseConnection->Read(_pType);
   _pType->UpdateTimestamp();
+
+  // Objects already loaded when a type is first checked get their baseline here
+  if (m_baselineTypes.insert(_pType->GetName()).second)
+  {
+    for (std::map<uint64_t, Serializable*>::iterator it = _pType->objects.begin(); it != _pType->objects.end(); ++it)
+      if (m_criticalDigests.find(it->second) == m_criticalDigests.end())
+        UpdateBaseline(it->second);
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -129,21 +468,33 @@ void DBSQL::OnSerializableUpdate(Serializable* _pObject) anope_override
   
   if(_pObject->id == 0)
     return OnSerializableConstruct(_pObject);
+
+  if (isDeferrable(_pObject))
+  {
+    m_deferredList.insert(std::make_pair(_pObject, Datastore::GetTime()));
+    return;
+  }
   
-  m_changeList.insert(std::pair<Serializable*, EACTION>(_pObject, UPDATE));
-  Notify();
+  QueueChange(_pObject, UPDATE);
 }
 
 //------------------------------------------------------------------------------
 void DBSQL::OnSerializableDestruct(Serializable* _pObject) anope_override
 {
-  if (!this->isConnectionReady())
-    return;
-  
-  if(_pObject->id != 0)
-    m_hDatabaseConnection->Destroy(_pObject);
+  // An object with a preallocated id may be destroyed before its insert was sent
+  std::map<Serializable*, Change>::iterator itChange = m_changeList.find(_pObject);
+  bool isPersisted = itChange == m_changeList.end() || itChange->second.eAction != CREATE;
 
+  // Local queues must never outlive the object, whether or not the database is reachable
   m_changeList.erase(_pObject);
+  m_deferredList.erase(_pObject);
+  m_criticalDigests.erase(_pObject);
   _pObject->GetSerializableType()->objects.erase(_pObject->id);
-}
 
+  // Only ids are kept, so the delete can wait until the database is ready
+  if(_pObject->id != 0 && isPersisted)
+  {
+    m_destroyList[_pObject->GetSerializableType()->GetName()].push_back(_pObject->id);
+    Notify();
+  }
+}
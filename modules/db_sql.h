@@ -7,21 +7,94 @@
 #include "module.h"
 #include "datastore.h"
 
+class DBSQL;
+
+//------------------------------------------------------------------------------
+// DBSQLFlushTimer
+//------------------------------------------------------------------------------
+class DBSQLFlushTimer : public Timer
+{
+  DBSQL& m_module;
+
+ public:
+  DBSQLFlushTimer(DBSQL* _pModule);
+
+  void Tick(time_t _now) anope_override;
+};
+
+//------------------------------------------------------------------------------
+// CommandOSSQLQueue
+//------------------------------------------------------------------------------
+class CommandOSSQLQueue : public Command
+{
+  DBSQL& m_module;
+
+ public:
+  CommandOSSQLQueue(DBSQL* _pModule);
+
+  void Execute(CommandSource& _source, const std::vector<Anope::string>& _params) anope_override;
+  bool OnHelp(CommandSource& _source, const Anope::string& _subcommand) anope_override;
+};
+
 //------------------------------------------------------------------------------
 // DBSQL
 //------------------------------------------------------------------------------
 class DBSQL : public Module, public Pipe
 {
+ public:
+  enum EPRIORITY { CRITICAL, DEFERRED, PRIORITY_COUNT };
+
+  struct QueueStatistics
+  {
+    unsigned long writes;
+    double lastLag;
+    double maxLag;
+  };
+
+ private:
   ServiceReference<Datastore::Provider> m_hDatabaseConnection;
+  Anope::string m_engine;
   bool m_isDatabaseLoaded;
   bool isConnectionReady();
   
   enum EACTION { CREATE, UPDATE };
-  std::map<Serializable*, EACTION> m_changeList;
+  struct Change
+  {
+    EACTION eAction;
+    double queuedAt;
+    unsigned long idGeneration;
+    unsigned int attempts;
+    time_t retryAt;
+  };
+  std::map<Serializable*, Change> m_changeList;
+  // Keyed by type name: a type can be unregistered while its deletes are still pending
+  std::map<Anope::string, std::vector<uint64_t> > m_destroyList;
+
+  // Updates touching only deferred fields wait for the flush timer, keyed to when they were first queued
+  std::map<Anope::string, std::set<Anope::string> > m_deferredFields;
+  std::map<Serializable*, double> m_deferredList;
+  std::map<Serializable*, uint64_t> m_criticalDigests;
+  std::set<Anope::string> m_baselineTypes;
+
+  QueueStatistics m_queueStatistics[PRIORITY_COUNT];
+  DBSQLFlushTimer m_flushTimer;
+  CommandOSSQLQueue m_commandOSSQLQueue;
+
+  void QueueChange(Serializable* _pObject, EACTION _eAction);
+  void ReleaseId(Serializable* _pObject);
+  void RecordLag(EPRIORITY _ePriority, double _lag);
+  const std::set<Anope::string>* GetDeferredFields(Serializable* _pObject) const;
+  uint64_t GetCriticalDigest(Serializable* _pObject, const std::set<Anope::string>& _deferredFields) const;
+  void UpdateBaseline(Serializable* _pObject);
+  bool isDeferrable(Serializable* _pObject);
 
  public:
   DBSQL(const Anope::string& _modname, const Anope::string& _creator);
 
+  void FlushDeferred();
+  size_t GetPendingCount(EPRIORITY _ePriority) const;
+  const QueueStatistics& GetQueueStatistics(EPRIORITY _ePriority) const { return m_queueStatistics[_ePriority]; }
+
   EventReturn OnLoadDatabase() anope_override;
   void OnShutdown() anope_override;
   void OnRestart() anope_override;
@@ -1,4 +1,4 @@
-/* RequiredLibraries: pq */
+/* RequiredLibraries: pq,rt */
 /* RequiredWindowsLibraries: libpq */
 //==============================================================================
 // File:	m_pgsql.cpp
@@ -6,11 +6,251 @@
 //==============================================================================
 #include "m_pgsql.h"
 
+//------------------------------------------------------------------------------
+// PgSQLProfiler
+//------------------------------------------------------------------------------
+static bool CompareTotalTime(const PgSQLProfiler::Statistics& _lhs, const PgSQLProfiler::Statistics& _rhs)
+{
+  return _lhs.totalTime > _rhs.totalTime;
+}
+
+//------------------------------------------------------------------------------
+PgSQLProfiler::PgSQLProfiler()
+  : m_slowQueryThreshold(0),
+  m_stallBudget(0),
+  m_stallCount(0)
+{
+
+}
+
+//------------------------------------------------------------------------------
+Anope::string PgSQLProfiler::Fingerprint(const Anope::string& _rawQuery)
+{
+  // Collapse literals and whitespace so statements differing only by value share a fingerprint
+  Anope::string fingerprint = "";
+  size_t length = _rawQuery.length();
+
+  for (size_t i = 0; i < length; ++i)
+  {
+    char c = _rawQuery[i];
+
+    if (c == '\'')
+    {
+      for (++i; i < length; ++i)
+      {
+        if (_rawQuery[i] != '\'')
+          continue;
+        if (i + 1 < length && _rawQuery[i + 1] == '\'')
+          ++i;
+        else
+          break;
+      }
+      fingerprint += '?';
+    }
+    else if (c == '"')
+    {
+      fingerprint += c;
+      for (++i; i < length && _rawQuery[i] != '"'; ++i)
+        fingerprint += _rawQuery[i];
+      fingerprint += '"';
+    }
+    else if (isdigit(c) && (i == 0 || !(isalnum(_rawQuery[i - 1]) || _rawQuery[i - 1] == '_')))
+    {
+      while (i + 1 < length && (isdigit(_rawQuery[i + 1]) || _rawQuery[i + 1] == '.'))
+        ++i;
+      fingerprint += '?';
+    }
+    else if (isspace(c))
+    {
+      if (!fingerprint.empty() && fingerprint[fingerprint.length() - 1] != ' ')
+        fingerprint += ' ';
+    }
+    else
+      fingerprint += c;
+  }
+
+  return CollapseValues(fingerprint.trim());
+}
+
+//------------------------------------------------------------------------------
+Anope::string PgSQLProfiler::CollapseValues(const Anope::string& _fingerprint)
+{
+  // Multi-row inserts of any size share a fingerprint: keep the first row after VALUES only
+  size_t start = _fingerprint.find_ci("VALUES (");
+  if (start == Anope::string::npos)
+    return _fingerprint;
+
+  size_t position = start + 7;
+  Anope::string collapsed = _fingerprint.substr(0, position);
+  bool isFirstRow = true;
+
+  while (position < _fingerprint.length() && _fingerprint[position] == '(')
+  {
+    size_t end = position;
+    for (int depth = 0; end < _fingerprint.length(); ++end)
+    {
+      if (_fingerprint[end] == '(')
+        ++depth;
+      else if (_fingerprint[end] == ')' && --depth == 0)
+        break;
+    }
+
+    if (isFirstRow)
+      collapsed += _fingerprint.substr(position, end - position + 1);
+    isFirstRow = false;
+
+    position = end + 1;
+    if (_fingerprint.substr(position, 2) == ", " && position + 2 < _fingerprint.length() && _fingerprint[position + 2] == '(')
+      position += 2;
+    else
+      break;
+  }
+
+  if (position < _fingerprint.length())
+    collapsed += _fingerprint.substr(position);
+
+  return collapsed;
+}
+
+//------------------------------------------------------------------------------
+bool PgSQLProfiler::Record(const Anope::string& _fingerprint, double _elapsed)
+{
+  std::map<Anope::string, Statistics>::iterator it = m_statistics.find(_fingerprint);
+  if (it == m_statistics.end())
+  {
+    Statistics statistics;
+    statistics.fingerprint = _fingerprint;
+    statistics.count = 0;
+    statistics.totalTime = 0;
+    statistics.maxTime = 0;
+    statistics.isExplained = false;
+    it = m_statistics.insert(std::make_pair(_fingerprint, statistics)).first;
+  }
+
+  Statistics& statistics = it->second;
+  statistics.count++;
+  statistics.totalTime += _elapsed;
+  if (_elapsed > statistics.maxTime)
+    statistics.maxTime = _elapsed;
+
+  if (m_slowQueryThreshold == 0 || _elapsed < m_slowQueryThreshold || statistics.isExplained)
+    return false;
+
+  statistics.isExplained = true;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool PgSQLProfiler::IsStall(double _elapsed)
+{
+  if (m_stallBudget == 0 || _elapsed <= m_stallBudget)
+    return false;
+
+  m_stallCount++;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+std::vector<PgSQLProfiler::Statistics> PgSQLProfiler::GetTop(size_t _count) const
+{
+  std::vector<Statistics> top;
+  for (std::map<Anope::string, Statistics>::const_iterator it = m_statistics.begin(); it != m_statistics.end(); ++it)
+    top.push_back(it->second);
+
+  if (_count > top.size())
+    _count = top.size();
+
+  std::partial_sort(top.begin(), top.begin() + _count, top.end(), CompareTotalTime);
+  top.resize(_count);
+
+  return top;
+}
+
+//------------------------------------------------------------------------------
+void PgSQLProfiler::Clear()
+{
+  m_statistics.clear();
+  m_stallCount = 0;
+}
+
+//------------------------------------------------------------------------------
+// CommandOSSQLStats
+//------------------------------------------------------------------------------
+CommandOSSQLStats::CommandOSSQLStats(Module* _pOwner, std::map<Anope::string, PgSQLConnection*>& _connections)
+  : Command(_pOwner, "operserv/sqlstats", 0, 1),
+  m_connections(_connections)
+{
+  this->SetDesc(_("Show the most expensive database statements"));
+  this->SetSyntax(_("[\037count\037 | CLEAR]"));
+}
+
+//------------------------------------------------------------------------------
+void CommandOSSQLStats::Execute(CommandSource& _source, const std::vector<Anope::string>& _params) anope_override
+{
+  const Anope::string& param = _params.empty() ? "" : _params[0];
+
+  if (param.equals_ci("CLEAR"))
+  {
+    for (std::map<Anope::string, PgSQLConnection*>::iterator it = m_connections.begin(); it != m_connections.end(); ++it)
+      it->second->GetProfiler().Clear();
+
+    Log(LOG_ADMIN, _source, this) << "to clear query statistics";
+    _source.Reply(_("Query statistics cleared."));
+    return;
+  }
+
+  unsigned int count = 10;
+  if (!param.empty())
+  {
+    try
+    {
+      count = convertTo<unsigned int>(param);
+    }
+    catch (const ConvertException &)
+    {
+      this->OnSyntaxError(_source, "");
+      return;
+    }
+  }
+
+  for (std::map<Anope::string, PgSQLConnection*>::iterator it = m_connections.begin(); it != m_connections.end(); ++it)
+  {
+    std::vector<PgSQLProfiler::Statistics> top = it->second->GetProfiler().GetTop(count);
+
+    _source.Reply(_("Top %u statements for \002%s\002 (%lu over the %ums stall budget):"), count, it->first.c_str(), it->second->GetProfiler().GetStallCount(), it->second->GetProfiler().GetStallBudget());
+    for (unsigned int i = 0; i < top.size(); ++i)
+    {
+      const PgSQLProfiler::Statistics& statistics = top[i];
+      _source.Reply(Anope::printf("%3u. calls=%lu total=%.1fms avg=%.1fms max=%.1fms%s", i + 1, statistics.count, statistics.totalTime, statistics.totalTime / statistics.count, statistics.maxTime, statistics.isExplained ? " [explained]" : ""));
+      _source.Reply("     " + statistics.fingerprint.substr(0, 300));
+    }
+  }
+
+  _source.Reply(_("End of query statistics."));
+}
+
+//------------------------------------------------------------------------------
+bool CommandOSSQLStats::OnHelp(CommandSource& _source, const Anope::string& _subcommand) anope_override
+{
+  this->SendSyntax(_source);
+  _source.Reply(" ");
+  _source.Reply(_("Lists the database statements which have consumed the most\n"
+                  "time, grouped by fingerprint (the statement with its literal\n"
+                  "values removed). \037count\037 defaults to 10.\n"
+                  " \n"
+                  "Statements exceeding the configured slow query threshold have\n"
+                  "their plan captured once to the \002pgsql/slow\002 log.\n"
+                  " \n"
+                  "\002SQLSTATS CLEAR\002 resets all collected statistics."));
+  return true;
+}
+
 //------------------------------------------------------------------------------
 // PgSQLModule
 //------------------------------------------------------------------------------
 PgSQLModule::PgSQLModule(const Anope::string& _name, const Anope::string& _creator)
-  : Module(_name, _creator, EXTRA | VENDOR)
+  : Module(_name, _creator, EXTRA | VENDOR),
+  m_commandOSSQLStats(this, m_connections)
 {
     
 }
@@ -30,42 +270,93 @@ PgSQLModule::~PgSQLModule()
 //------------------------------------------------------------------------------
 void PgSQLModule::OnReload(Configuration::Conf* _pConfig) anope_override
 {
-  // Disconnect
-  for (std::map<Anope::string, PgSQLConnection*>::iterator hCurrentConnection = m_connections.begin(); hCurrentConnection != m_connections.end(); ++hCurrentConnection)
-  {
-    delete hCurrentConnection->second;
-    Log(LOG_NORMAL, "pgsql") << "PgSQL: Removing server connection " << hCurrentConnection->first;
-  }
-  m_connections.clear();
-  
-  // Connect
+  // Connections are diffed against the config so an unchanged block keeps its live connection
+  std::set<Anope::string> configuredConnections;
+
   Configuration::Block* pBlock = _pConfig->GetModule(this);
   for (int i = 0; i < pBlock->CountBlock("pgsql"); ++i)
   {
     Configuration::Block* pPgSQLBlock = pBlock->GetBlock("pgsql", i);
     const Anope::string& connectionName = pPgSQLBlock->Get<const Anope::string>("name", "pgsql/main");
 
-    if (this->m_connections.find(connectionName) == this->m_connections.end())
+    if (!configuredConnections.insert(connectionName).second)
+      continue;
+
+    const Anope::string &user     = pPgSQLBlock->Get<const Anope::string>("username", "anope");
+    const Anope::string &password = pPgSQLBlock->Get<const Anope::string>("password");
+    const Anope::string &server   = pPgSQLBlock->Get<const Anope::string>("server", "127.0.0.1");
+    const Anope::string &port     = pPgSQLBlock->Get<const Anope::string>("port", "5432");
+    const Anope::string &database = pPgSQLBlock->Get<const Anope::string>("database", "anope");
+    const Anope::string &schema   = pPgSQLBlock->Get<const Anope::string>("schema", "public");
+    unsigned int slowQueryThreshold = pPgSQLBlock->Get<unsigned int>("slowquerythreshold", "250");
+    unsigned int idBlockSize = pPgSQLBlock->Get<unsigned int>("idblocksize", "50");
+    unsigned int stallBudget = pPgSQLBlock->Get<unsigned int>("stallbudget", "100");
+
+    PgSQLConnection* pConnection = NULL;
+    try
     {
-      const Anope::string &user     = pPgSQLBlock->Get<const Anope::string>("username", "anope");
-      const Anope::string &password = pPgSQLBlock->Get<const Anope::string>("password");
-      const Anope::string &server   = pPgSQLBlock->Get<const Anope::string>("server", "127.0.0.1");
-      const Anope::string &port     = pPgSQLBlock->Get<const Anope::string>("port", "5432");
-      const Anope::string &database = pPgSQLBlock->Get<const Anope::string>("database", "anope");
-      const Anope::string &schema   = pPgSQLBlock->Get<const Anope::string>("schema", "public");
-      
-      try
+      std::map<Anope::string, PgSQLConnection*>::iterator hCurrentConnection = m_connections.find(connectionName);
+      if (hCurrentConnection == m_connections.end())
       {
-        PgSQLConnection* pConnection = new PgSQLConnection(this, connectionName, database, server, user, password, port);
+        pConnection = new PgSQLConnection(this, connectionName, database, server, user, password, port);
         this->m_connections.insert(std::make_pair(connectionName, pConnection));
 
         Log(LOG_NORMAL, "pgsql") << "PgSQL: Successfully connected to server " << connectionName << " (" << server << ")";
       }
-      catch (const Datastore::Exception& exception)
+      else
       {
-        Log(LOG_NORMAL, "pgsql") << "PgSQL: " << exception.GetReason();
+        pConnection = hCurrentConnection->second;
+        if (!pConnection->IsConfiguredAs(database, server, user, password, port))
+        {
+          pConnection->Reconfigure(database, server, user, password, port);
+          Log(LOG_NORMAL, "pgsql") << "PgSQL: Successfully reconnected to server " << connectionName << " (" << server << ")";
+        }
       }
     }
+    catch (const Datastore::Exception& exception)
+    {
+      Log(LOG_NORMAL, "pgsql") << "PgSQL: " << exception.GetReason();
+      if (!pConnection)
+        continue;
+    }
+
+    pConnection->GetProfiler().SetSlowQueryThreshold(slowQueryThreshold);
+    pConnection->SetIdBlockSize(idBlockSize ? idBlockSize : 1);
+    pConnection->GetProfiler().SetStallBudget(stallBudget);
+
+    std::map<Anope::string, PgSQLConnection::PartitionPolicy> partitionPolicies;
+    for (int j = 0; j < pPgSQLBlock->CountBlock("partition"); ++j)
+    {
+      Configuration::Block* pPartitionBlock = pPgSQLBlock->GetBlock("partition", j);
+      const Anope::string& type     = pPartitionBlock->Get<const Anope::string>("type");
+      const Anope::string& interval = pPartitionBlock->Get<const Anope::string>("interval", "month");
+
+      if (type.empty() || (interval != "month" && interval != "day"))
+      {
+        Log(LOG_NORMAL, "pgsql") << "PgSQL: Ignoring invalid partition block for " << connectionName;
+        continue;
+      }
+
+      PgSQLConnection::PartitionPolicy& policy = partitionPolicies[type];
+      policy.interval = interval;
+      policy.retention = pPartitionBlock->Get<unsigned int>("retention");
+      policy.isEnabled = true;
+    }
+    pConnection->SetPartitionPolicies(partitionPolicies);
+  }
+
+  // Disconnect
+  for (std::map<Anope::string, PgSQLConnection*>::iterator hCurrentConnection = m_connections.begin(); hCurrentConnection != m_connections.end();)
+  {
+    if (configuredConnections.count(hCurrentConnection->first))
+    {
+      ++hCurrentConnection;
+      continue;
+    }
+
+    delete hCurrentConnection->second;
+    Log(LOG_NORMAL, "pgsql") << "PgSQL: Removing server connection " << hCurrentConnection->first;
+    m_connections.erase(hCurrentConnection++);
   }
 }
 
@@ -90,6 +381,53 @@ void PgSQLConnection::Connect()
   Log(LOG_DEBUG) << "Successfully connected to the postgres server " << this->name << " at " << this->m_hostname << ":" << this->m_port;
 }
 
+//------------------------------------------------------------------------------
+bool PgSQLConnection::IsConfiguredAs(const Anope::string& _database, const Anope::string& _hostname, const Anope::string& _username, const Anope::string& _password, const Anope::string& _port) const
+{
+  return m_database == _database && m_hostname == _hostname && m_username == _username && m_password == _password && m_port == _port;
+}
+
+//------------------------------------------------------------------------------
+void PgSQLConnection::Reconfigure(const Anope::string& _database, const Anope::string& _hostname, const Anope::string& _username, const Anope::string& _password, const Anope::string& _port)
+{
+  // Keep serving on the old connection until the new one is established
+  PGconn* pPreviousConnection = m_pConnection;
+  const Anope::string previousDatabase = m_database;
+  const Anope::string previousHostname = m_hostname;
+  const Anope::string previousUsername = m_username;
+  const Anope::string previousPassword = m_password;
+  const Anope::string previousPort = m_port;
+
+  m_database = _database;
+  m_hostname = _hostname;
+  m_username = _username;
+  m_password = _password;
+  m_port = _port;
+
+  try
+  {
+    Connect();
+  }
+  catch (const Datastore::Exception &)
+  {
+    PQfinish(m_pConnection);
+    m_pConnection = pPreviousConnection;
+    m_database = previousDatabase;
+    m_hostname = previousHostname;
+    m_username = previousUsername;
+    m_password = previousPassword;
+    m_port = previousPort;
+    throw;
+  }
+
+  PQfinish(pPreviousConnection);
+
+  // Ids preallocated from the old server's sequences are not valid on the new one
+  m_idBlocks.clear();
+  m_missingTables.clear();
+  ++m_idGeneration;
+}
+
 //------------------------------------------------------------------------------
 void PgSQLConnection::Disconnect()
 {
@@ -102,6 +440,9 @@ bool PgSQLConnection::isConnected()
 {
   if (!m_pConnection || (PQstatus(m_pConnection) == CONNECTION_BAD))
   {
+    if (m_pConnection)
+      Disconnect();
+
     try
     {
       Connect();
@@ -116,23 +457,106 @@ bool PgSQLConnection::isConnected()
   return true;
 }
 
+//------------------------------------------------------------------------------
+void PgSQLConnection::CheckStall(double _startTime, const Anope::string& _fingerprint)
+{
+  double elapsed = Datastore::GetTime() - _startTime;
+  if (!m_profiler.IsStall(elapsed))
+    return;
+
+  Log(LOG_NORMAL, "pgsql") << "PgSQL: " << _fingerprint << " on " << this->name << " blocked the event loop for " << stringify(elapsed) << "ms (budget " << stringify(m_profiler.GetStallBudget()) << "ms)";
+}
+
 //------------------------------------------------------------------------------
 PGresult* PgSQLConnection::Query(const Anope::string& _rawQuery)
 {
+  // Reconnecting and capturing a plan block the loop just like the statement itself
+  double startTime = Datastore::GetTime();
+
   if(!isConnected())
+  {
+    CheckStall(startTime, "Reconnect");
     return NULL;
-  
+  }
+
   PGresult* pResult = PQexec(m_pConnection, _rawQuery.c_str());
+
+  double elapsed = Datastore::GetTime() - startTime;
   
   if(pResult)
     Log(LOG_DEBUG) << "PGSQL: " << PQresultErrorMessage(pResult);
 
+  Anope::string fingerprint = PgSQLProfiler::Fingerprint(_rawQuery);
+  if (m_profiler.Record(fingerprint, elapsed))
+  {
+    Log(LOG_NORMAL, "pgsql/slow") << "PgSQL: Slow query on " << this->name << " (" << stringify(elapsed) << "ms): " << fingerprint;
+    Explain(fingerprint, _rawQuery);
+  }
+
+  CheckStall(startTime, fingerprint);
+
   return pResult;
 }
 
+//------------------------------------------------------------------------------
+void PgSQLConnection::Explain(const Anope::string& _fingerprint, const Anope::string& _rawQuery)
+{
+  // Split into individual statements; EXPLAIN only accepts one at a time
+  std::vector<Anope::string> statements;
+  Anope::string statement = "";
+  bool isQuoted = false;
+
+  for (size_t i = 0; i < _rawQuery.length(); ++i)
+  {
+    char c = _rawQuery[i];
+
+    if (c == '\'')
+      isQuoted = !isQuoted;
+
+    if (c == ';' && !isQuoted)
+    {
+      statements.push_back(statement.trim());
+      statement = "";
+    }
+    else
+      statement += c;
+  }
+  statements.push_back(statement.trim());
+
+  for (std::vector<Anope::string>::iterator it = statements.begin(); it != statements.end(); ++it)
+  {
+    Anope::string keyword = it->substr(0, it->find(' '));
+
+    if (!keyword.equals_ci("SELECT") && !keyword.equals_ci("INSERT") && !keyword.equals_ci("UPDATE") && !keyword.equals_ci("DELETE"))
+      continue;
+
+    // ANALYZE executes the statement and a rollback does not return sequence values,
+    // so anything that may draw from a sequence is only planned
+    bool isAnalyzed = !keyword.equals_ci("INSERT") && it->find_ci("nextval") == Anope::string::npos;
+
+    PQclear(PQexec(m_pConnection, "BEGIN"));
+    PGresult* pResult = PQexec(m_pConnection, ((isAnalyzed ? "EXPLAIN (ANALYZE, BUFFERS) " : "EXPLAIN ") + *it).c_str());
+
+    if (PQresultStatus(pResult) == PGRES_TUPLES_OK)
+    {
+      for (int row = 0; row < PQntuples(pResult); ++row)
+        Log(LOG_NORMAL, "pgsql/slow") << "PgSQL:   " << PQgetvalue(pResult, row, 0);
+    }
+    else
+      Log(LOG_NORMAL, "pgsql/slow") << "PgSQL: Unable to explain " << _fingerprint << ": " << PQresultErrorMessage(pResult);
+
+    PQclear(pResult);
+    PQclear(PQexec(m_pConnection, "ROLLBACK"));
+  }
+}
+
 //------------------------------------------------------------------------------
 Anope::string PgSQLConnection::EscapeString(const Anope::string& _rawQuery)
 {
+  // Escaping without a connection yields an empty string, which would be written as the value
+  if (!isConnected())
+    throw Datastore::Exception("Unable to escape values without a connection to " + this->name);
+
   std::vector<char> escapedBuffer(_rawQuery.length() * 2 + 1);
   int error;
 
@@ -150,11 +574,15 @@ Anope::string PgSQLConnection::BuildCreateTableQuery(Serializable* _pObject)
   Data serialized_data;
   _pObject->Serialize(serialized_data);
 
+  const Anope::string& table = _pObject->GetSerializableType()->GetName();
+  std::map<Anope::string, PartitionPolicy>::iterator itPolicy = m_partitionPolicies.find(table);
+  bool isPartitioned = itPolicy != m_partitionPolicies.end() && itPolicy->second.isEnabled;
+
   Anope::string rawQuery = "";
   rawQuery += "CREATE TABLE IF NOT EXISTS \"";
-  rawQuery += _pObject->GetSerializableType()->GetName();
+  rawQuery += table;
   rawQuery += "\" (";
-  rawQuery += "\"id\" serial primary key, ";
+  rawQuery += isPartitioned ? "\"id\" serial, " : "\"id\" serial primary key, ";
   
   for (Data::Map::const_iterator it = serialized_data.data.begin(), it_end = serialized_data.data.end(); it != it_end; ++it)
   {
@@ -181,22 +609,161 @@ Anope::string PgSQLConnection::BuildCreateTableQuery(Serializable* _pObject)
     rawQuery += ", ";
   }
   
-  rawQuery += "\"created_at\" timestamp NOT NULL, \"updated_at\" timestamp NOT NULL); ";
+  rawQuery += "\"created_at\" timestamp NOT NULL, \"updated_at\" timestamp NOT NULL";
+
+  if (isPartitioned)
+  {
+    // The partition key must be part of the primary key
+    rawQuery += ", PRIMARY KEY (\"id\", \"created_at\")) PARTITION BY RANGE (\"created_at\"); ";
+  }
+  else
+    rawQuery += "); ";
   
   return rawQuery;
 }
 
+//------------------------------------------------------------------------------
+Anope::string PgSQLConnection::BuildPartitionBoundsQuery(const Anope::string& _table, const PartitionPolicy& _policy)
+{
+  // Bounds are computed in the session time zone, the same one CURRENT_TIMESTAMP is stored in
+  const Anope::string nameFormat = _policy.interval == "month" ? "YYYY_MM" : "YYYY_MM_DD";
+  const Anope::string step = "interval '1 " + _policy.interval + "'";
+
+  Anope::string rawQuery = "";
+  rawQuery += "SELECT c.\"relkind\", ";
+  rawQuery += "to_char(b.\"start\", '" + nameFormat + "'), ";
+  rawQuery += "to_char(b.\"start\" + " + step + ", '" + nameFormat + "'), ";
+  rawQuery += "to_char(b.\"start\" - " + stringify(_policy.retention) + " * " + step + ", '" + nameFormat + "'), ";
+  rawQuery += "to_char(b.\"start\", 'YYYY-MM-DD'), ";
+  rawQuery += "to_char(b.\"start\" + " + step + ", 'YYYY-MM-DD'), ";
+  rawQuery += "to_char(b.\"start\" + 2 * " + step + ", 'YYYY-MM-DD') ";
+  rawQuery += "FROM \"pg_class\" c, (SELECT date_trunc('" + _policy.interval + "', LOCALTIMESTAMP) AS \"start\") b ";
+  rawQuery += "WHERE c.\"oid\" = to_regclass('\"" + EscapeString(_table) + "\"'); ";
+
+  return rawQuery;
+}
+
+//------------------------------------------------------------------------------
+Anope::string PgSQLConnection::BuildCreatePartitionQuery(const Anope::string& _table, const Anope::string& _suffix, const Anope::string& _from, const Anope::string& _to)
+{
+  Anope::string rawQuery = "";
+  rawQuery += "CREATE TABLE IF NOT EXISTS \"";
+  rawQuery += _table + "_p" + _suffix;
+  rawQuery += "\" PARTITION OF \"";
+  rawQuery += _table;
+  rawQuery += "\" FOR VALUES FROM ('";
+  rawQuery += _from;
+  rawQuery += "') TO ('";
+  rawQuery += _to;
+  rawQuery += "'); ";
+
+  return rawQuery;
+}
+
+//------------------------------------------------------------------------------
+void PgSQLConnection::EnsurePartitions(Serializable* _pObject)
+{
+  const Anope::string& table = _pObject->GetSerializableType()->GetName();
+  std::map<Anope::string, PartitionPolicy>::iterator itPolicy = m_partitionPolicies.find(table);
+  if (itPolicy == m_partitionPolicies.end() || !itPolicy->second.isEnabled)
+    return;
+
+  PartitionPolicy& policy = itPolicy->second;
+
+  // The local clock only decides when to check again. The current and next partitions
+  // always exist, which covers any offset between UTC and the server's time zone.
+  struct tm now = *gmtime(&Anope::CurTime);
+  char period[16];
+  strftime(period, sizeof(period), policy.interval == "month" ? "%Y_%m" : "%Y_%m_%d", &now);
+
+  if (policy.period == period)
+    return;
+
+  // Creates the table partitioned when it does not exist yet
+  PGresult* pResult = Query(BuildCreateTableQuery(_pObject) + BuildPartitionBoundsQuery(table, policy));
+  if (pResult == NULL)
+    return;
+
+  if (PQresultStatus(pResult) != PGRES_TUPLES_OK || PQntuples(pResult) != 1)
+  {
+    PQclear(pResult);
+    return;
+  }
+
+  if (strcmp(PQgetvalue(pResult, 0, 0), "p") != 0)
+  {
+    Log(LOG_NORMAL, "pgsql") << "PgSQL: Table " << table << " already exists without partitioning, ignoring its partition policy";
+    policy.isEnabled = false;
+    PQclear(pResult);
+    return;
+  }
+
+  const Anope::string currentSuffix = PQgetvalue(pResult, 0, 1);
+  const Anope::string nextSuffix = PQgetvalue(pResult, 0, 2);
+  const Anope::string retainedSuffix = PQgetvalue(pResult, 0, 3);
+  const Anope::string rawQuery = BuildCreatePartitionQuery(table, currentSuffix, PQgetvalue(pResult, 0, 4), PQgetvalue(pResult, 0, 5))
+    + BuildCreatePartitionQuery(table, nextSuffix, PQgetvalue(pResult, 0, 5), PQgetvalue(pResult, 0, 6));
+  PQclear(pResult);
+
+  pResult = Query(rawQuery);
+  if (pResult == NULL)
+    return;
+
+  bool isCreated = PQresultStatus(pResult) == PGRES_COMMAND_OK;
+  PQclear(pResult);
+
+  if (!isCreated)
+    return;
+
+  policy.period = period;
+
+  if (policy.retention == 0)
+    return;
+
+  // Partitions are named by period, so older ones sort before the oldest retained name
+  pResult = Query("SELECT c.\"relname\" FROM \"pg_inherits\" i JOIN \"pg_class\" c ON c.\"oid\" = i.\"inhrelid\" WHERE i.\"inhparent\" = to_regclass('\"" + EscapeString(table) + "\"') AND c.\"relname\" < '" + EscapeString(table + "_p" + retainedSuffix) + "'; ");
+  if (pResult == NULL)
+    return;
+
+  Anope::string dropQuery = "";
+  if (PQresultStatus(pResult) == PGRES_TUPLES_OK)
+  {
+    for (int row = 0; row < PQntuples(pResult); ++row)
+    {
+      Log(LOG_NORMAL, "pgsql") << "PgSQL: Dropping expired partition " << PQgetvalue(pResult, row, 0);
+      dropQuery += "DROP TABLE IF EXISTS \"" + Anope::string(PQgetvalue(pResult, row, 0)) + "\"; ";
+    }
+  }
+  PQclear(pResult);
+
+  if (!dropQuery.empty())
+  {
+    pResult = Query(dropQuery);
+    if (pResult)
+      PQclear(pResult);
+  }
+}
+
 //------------------------------------------------------------------------------
 Anope::string PgSQLConnection::BuildInsertRowQuery(Serializable* _pObject)
 {
-  Log(LOG_DEBUG) << "BuildInsertRowQuery - " + _pObject->GetSerializableType()->GetName();
+  return BuildInsertRowsQuery(std::vector<Serializable*>(1, _pObject));
+}
+
+//------------------------------------------------------------------------------
+Anope::string PgSQLConnection::BuildInsertRowsQuery(const std::vector<Serializable*>& _objects)
+{
+  // All rows must be of the same type and serialize the same fields as the first one
+  Serializable* pFirstObject = _objects.front();
+
+  Log(LOG_DEBUG) << "BuildInsertRowsQuery - " + pFirstObject->GetSerializableType()->GetName() << ":" << stringify(_objects.size());
   
   Data serialized_data;
-  _pObject->Serialize(serialized_data);
+  pFirstObject->Serialize(serialized_data);
   
   Anope::string rawQuery = "";
   rawQuery += "INSERT INTO \"";
-  rawQuery += _pObject->GetSerializableType()->GetName();
+  rawQuery += pFirstObject->GetSerializableType()->GetName();
   rawQuery += "\" (";
   
   for (Data::Map::const_iterator it = serialized_data.data.begin(), it_end = serialized_data.data.end(); it != it_end; ++it)
@@ -209,23 +776,44 @@ Anope::string PgSQLConnection::BuildInsertRowQuery(Serializable* _pObject)
     rawQuery += "\", ";
   }
   
-  rawQuery += "\"created_at\", \"updated_at\") VALUES (";
-  
+  if (pFirstObject->id != 0)
+    rawQuery += "\"id\", ";
+
+  rawQuery += "\"created_at\", \"updated_at\") VALUES ";
   
-  for (Data::Map::const_iterator it = serialized_data.data.begin(), it_end = serialized_data.data.end(); it != it_end; ++it)
+  for (std::vector<Serializable*>::const_iterator itObject = _objects.begin(); itObject != _objects.end(); ++itObject)
   {
-    if(strcmp(it->first.c_str(), "id") == 0)
-      continue;
+    Data row_data;
+    (*itObject)->Serialize(row_data);
 
-    Anope::string buffer;
-    *it->second >> buffer;
+    if (itObject != _objects.begin())
+      rawQuery += ", ";
+    rawQuery += "(";
+
+    for (Data::Map::const_iterator it = row_data.data.begin(), it_end = row_data.data.end(); it != it_end; ++it)
+    {
+      if(strcmp(it->first.c_str(), "id") == 0)
+        continue;
+
+      Anope::string buffer;
+      *it->second >> buffer;
+      
+      rawQuery += "'";
+      rawQuery += EscapeString(buffer);
+      rawQuery += "', ";
+    }
     
-    rawQuery += "'";
-    rawQuery += EscapeString(buffer);
-    rawQuery += "', ";
+    // Preallocated ids are sent explicitly, otherwise the sequence assigns one
+    if ((*itObject)->id != 0)
+    {
+      rawQuery += stringify((*itObject)->id);
+      rawQuery += ", ";
+    }
+
+    rawQuery += "CURRENT_TIMESTAMP, CURRENT_TIMESTAMP)";
   }
-  
-  rawQuery += "CURRENT_TIMESTAMP, CURRENT_TIMESTAMP) RETURNING \"id\"; ";
+
+  rawQuery += pFirstObject->id != 0 ? "; " : " RETURNING \"id\"; ";
   
   return rawQuery;
 }
@@ -265,6 +853,75 @@ Anope::string PgSQLConnection::BuildUpdateRowQuery(Serializable* _pObject)
   return rawQuery;
 }
 
+//------------------------------------------------------------------------------
+Anope::string PgSQLConnection::BuildUpdateRowsQuery(std::vector<Serializable*>::const_iterator _begin, std::vector<Serializable*>::const_iterator _end)
+{
+  Serializable* pFirstObject = *_begin;
+  const Anope::string& table = pFirstObject->GetSerializableType()->GetName();
+
+  Data serialized_data;
+  pFirstObject->Serialize(serialized_data);
+
+  // The new values are joined in as a VALUES list, cast back to the column types on assignment
+  Anope::string rawQuery = "";
+  rawQuery += "UPDATE \"";
+  rawQuery += table;
+  rawQuery += "\" SET ";
+
+  Anope::string columns = "\"id\"";
+  for (Data::Map::const_iterator it = serialized_data.data.begin(), it_end = serialized_data.data.end(); it != it_end; ++it)
+  {
+    if(strcmp(it->first.c_str(), "id") == 0)
+      continue;
+
+    rawQuery += "\"";
+    rawQuery += it->first;
+    rawQuery += "\" = v.\"";
+    rawQuery += it->first;
+    rawQuery += serialized_data.GetType(it->first) == Data::DT_INT ? "\"::integer, " : "\"::character varying, ";
+
+    columns += ", \"";
+    columns += it->first;
+    columns += "\"";
+  }
+
+  rawQuery += "\"updated_at\" = CURRENT_TIMESTAMP FROM (VALUES ";
+
+  for (std::vector<Serializable*>::const_iterator itObject = _begin; itObject != _end; ++itObject)
+  {
+    Data row_data;
+    (*itObject)->Serialize(row_data);
+
+    if (itObject != _begin)
+      rawQuery += ", ";
+    rawQuery += "(";
+    rawQuery += stringify((*itObject)->id);
+
+    for (Data::Map::const_iterator it = row_data.data.begin(), it_end = row_data.data.end(); it != it_end; ++it)
+    {
+      if(strcmp(it->first.c_str(), "id") == 0)
+        continue;
+
+      Anope::string buffer;
+      *it->second >> buffer;
+
+      rawQuery += ", '";
+      rawQuery += EscapeString(buffer);
+      rawQuery += "'";
+    }
+
+    rawQuery += ")";
+  }
+
+  rawQuery += ") AS v(";
+  rawQuery += columns;
+  rawQuery += ") WHERE \"";
+  rawQuery += table;
+  rawQuery += "\".\"id\" = v.\"id\"; ";
+
+  return rawQuery;
+}
+
 //------------------------------------------------------------------------------
 Anope::string PgSQLConnection::BuildDestroyRowQuery(Serializable* _pObject)
 {
@@ -283,6 +940,39 @@ Anope::string PgSQLConnection::BuildDestroyRowQuery(Serializable* _pObject)
   return rawQuery;
 }
 
+//------------------------------------------------------------------------------
+Anope::string PgSQLConnection::BuildDestroyRowsQuery(const Anope::string& _table, std::vector<uint64_t>::const_iterator _begin, std::vector<uint64_t>::const_iterator _end)
+{
+  Anope::string rawQuery = "";
+  rawQuery += "DELETE FROM \"";
+  rawQuery += _table;
+  rawQuery += "\" WHERE \"id\" = ANY('{";
+
+  for (std::vector<uint64_t>::const_iterator it = _begin; it != _end; ++it)
+  {
+    if (it != _begin)
+      rawQuery += ",";
+    rawQuery += stringify(*it);
+  }
+
+  rawQuery += "}'::integer[]); ";
+
+  return rawQuery;
+}
+
+//------------------------------------------------------------------------------
+Anope::string PgSQLConnection::BuildAllocateIdsQuery(Serialize::Type* _pType)
+{
+  Anope::string rawQuery = "";
+  rawQuery += "SELECT nextval(pg_get_serial_sequence('\"";
+  rawQuery += EscapeString(_pType->GetName());
+  rawQuery += "\"', 'id')) FROM generate_series(1, ";
+  rawQuery += stringify(m_idBlockSize);
+  rawQuery += "); ";
+
+  return rawQuery;
+}
+
 //------------------------------------------------------------------------------
 PgSQLConnection::PgSQLConnection(Module* _pOwner, const Anope::string& _name, const Anope::string& _database, const Anope::string& _hostname, const Anope::string& _username, const Anope::string& _password, const Anope::string& _port)
   : Provider(_pOwner, _name),
@@ -291,7 +981,9 @@ PgSQLConnection::PgSQLConnection(Module* _pOwner, const Anope::string& _name, co
   m_hostname(_hostname),
   m_port(_port),
   m_database(_database),
-  m_pConnection(NULL)
+  m_pConnection(NULL),
+  m_idBlockSize(50),
+  m_idGeneration(0)
 {
   Connect();
 }
@@ -303,21 +995,174 @@ PgSQLConnection::~PgSQLConnection()
 }
 
 //------------------------------------------------------------------------------
-void PgSQLConnection::Create(Serializable* _pObject) anope_override
+void PgSQLConnection::SetPartitionPolicies(const std::map<Anope::string, PartitionPolicy>& _policies)
+{
+  // Unchanged policies keep what is already known about their tables
+  std::map<Anope::string, PartitionPolicy> policies = _policies;
+  for (std::map<Anope::string, PartitionPolicy>::iterator it = policies.begin(); it != policies.end(); ++it)
+  {
+    std::map<Anope::string, PartitionPolicy>::const_iterator itCurrent = m_partitionPolicies.find(it->first);
+    if (itCurrent != m_partitionPolicies.end() && itCurrent->second.interval == it->second.interval && itCurrent->second.retention == it->second.retention)
+      it->second = itCurrent->second;
+  }
+
+  m_partitionPolicies.swap(policies);
+}
+
+//------------------------------------------------------------------------------
+bool PgSQLConnection::Create(Serializable* _pObject) anope_override
 {  
   Log(LOG_DEBUG) << "PGSQL::Create - " << _pObject->GetSerializableType()->GetName();
-  
-  PGresult* pResult = Query(BuildCreateTableQuery(_pObject) + BuildInsertRowQuery(_pObject));
+
+  PGresult* pResult = NULL;
+  try
+  {
+    EnsurePartitions(_pObject);
+    pResult = Query(BuildCreateTableQuery(_pObject) + BuildInsertRowQuery(_pObject));
+  }
+  catch (const Datastore::Exception& exception)
+  {
+    Log(LOG_DEBUG) << "PGSQL: " << exception.GetReason();
+  }
   
   if(pResult == NULL)
-    return;
-  
-  if(PQbinaryTuples(pResult))
-    _pObject->id = ntohl(*(int*)PQgetvalue(pResult, 0, 0));
-  else
-    _pObject->id = atoi(PQgetvalue(pResult, 0, 0));
+    return false;
+
+  bool isInserted = false;
+  if(_pObject->id != 0)
+    isInserted = PQresultStatus(pResult) == PGRES_COMMAND_OK && atoi(PQcmdTuples(pResult)) == 1;
+  else if(PQresultStatus(pResult) == PGRES_TUPLES_OK && PQntuples(pResult) == 1)
+  {
+    if(PQbinaryTuples(pResult))
+      _pObject->id = ntohl(*(int*)PQgetvalue(pResult, 0, 0));
+    else
+      _pObject->id = atoi(PQgetvalue(pResult, 0, 0));
+
+    isInserted = true;
+  }
 
   PQclear(pResult);
+
+  if (isInserted)
+    m_missingTables.erase(_pObject->GetSerializableType()->GetName());
+
+  return isInserted;
+}
+
+//------------------------------------------------------------------------------
+void PgSQLConnection::Create(const std::vector<Serializable*>& _objects, std::vector<Serializable*>& _failed) anope_override
+{
+  // Rows of the same type serializing the same fields share one multi-row INSERT
+  std::map<Anope::string, std::vector<Serializable*> > batches;
+
+  for (std::vector<Serializable*>::const_iterator it = _objects.begin(); it != _objects.end(); ++it)
+  {
+    Serializable* pObject = *it;
+
+    if (pObject->id == 0)
+    {
+      if (!Create(pObject))
+        _failed.push_back(pObject);
+      continue;
+    }
+
+    Data serialized_data;
+    pObject->Serialize(serialized_data);
+
+    Anope::string signature = pObject->GetSerializableType()->GetName();
+    for (Data::Map::const_iterator itData = serialized_data.data.begin(); itData != serialized_data.data.end(); ++itData)
+      signature += " " + itData->first;
+
+    batches[signature].push_back(pObject);
+  }
+
+  for (std::map<Anope::string, std::vector<Serializable*> >::iterator it = batches.begin(); it != batches.end(); ++it)
+  {
+    const std::vector<Serializable*>& batch = it->second;
+
+    if (batch.size() == 1)
+    {
+      if (!Create(batch.front()))
+        _failed.push_back(batch.front());
+      continue;
+    }
+
+    Log(LOG_DEBUG) << "PGSQL::Create - " << batch.front()->GetSerializableType()->GetName() << ":" << stringify(batch.size()) << " rows";
+
+    PGresult* pResult = NULL;
+    try
+    {
+      EnsurePartitions(batch.front());
+      pResult = Query(BuildCreateTableQuery(batch.front()) + BuildInsertRowsQuery(batch));
+    }
+    catch (const Datastore::Exception& exception)
+    {
+      Log(LOG_DEBUG) << "PGSQL: " << exception.GetReason();
+    }
+
+    bool isInserted = pResult && PQresultStatus(pResult) == PGRES_COMMAND_OK && static_cast<size_t>(atoi(PQcmdTuples(pResult))) == batch.size();
+
+    if (pResult)
+      PQclear(pResult);
+
+    if (isInserted)
+    {
+      m_missingTables.erase(batch.front()->GetSerializableType()->GetName());
+      continue;
+    }
+
+    // One bad row fails the whole statement, so fall back to single rows to isolate it
+    for (std::vector<Serializable*>::const_iterator itObject = batch.begin(); itObject != batch.end(); ++itObject)
+      if (!Create(*itObject))
+        _failed.push_back(*itObject);
+  }
+}
+
+//------------------------------------------------------------------------------
+uint64_t PgSQLConnection::AllocateId(Serialize::Type* _pType) anope_override
+{
+  std::deque<uint64_t>& ids = m_idBlocks[_pType->GetName()];
+
+  // Until the first insert creates the table there is no sequence to draw from
+  if (ids.empty() && m_missingTables.count(_pType->GetName()))
+    return 0;
+
+  if (ids.empty())
+  {
+    Log(LOG_DEBUG) << "PGSQL::AllocateId - " << _pType->GetName() << ":" << stringify(m_idBlockSize);
+
+    // Fails while the table does not exist; the caller then falls back to RETURNING
+    PGresult* pResult = NULL;
+    try
+    {
+      pResult = Query(BuildAllocateIdsQuery(_pType));
+    }
+    catch (const Datastore::Exception& exception)
+    {
+      Log(LOG_DEBUG) << "PGSQL: " << exception.GetReason();
+    }
+
+    if(pResult == NULL)
+      return 0;
+
+    if(PQresultStatus(pResult) == PGRES_TUPLES_OK)
+    {
+      for (int row = 0; row < PQntuples(pResult); ++row)
+        ids.push_back(strtoull(PQgetvalue(pResult, row, 0), NULL, 10));
+    }
+    else
+      m_missingTables.insert(_pType->GetName());
+
+    PQclear(pResult);
+
+    if (ids.empty())
+      return 0;
+  }
+
+  uint64_t id = ids.front();
+  ids.pop_front();
+
+  return id;
 }
 
 //------------------------------------------------------------------------------
@@ -407,7 +1252,15 @@ void PgSQLConnection::Update(Serializable* _pObject) anope_override
 {
   Log(LOG_DEBUG) << "PGSQL::Update - " << _pObject->GetSerializableType()->GetName() << ":" << stringify(_pObject->id);
 
-  PGresult* pResult = Query(BuildUpdateRowQuery(_pObject));
+  PGresult* pResult = NULL;
+  try
+  {
+    pResult = Query(BuildUpdateRowQuery(_pObject));
+  }
+  catch (const Datastore::Exception& exception)
+  {
+    Log(LOG_NORMAL, "pgsql") << "PgSQL: " << exception.GetReason();
+  }
   
   if(pResult == NULL)
     return;
@@ -415,6 +1268,58 @@ void PgSQLConnection::Update(Serializable* _pObject) anope_override
   PQclear(pResult);
 }
 
+//------------------------------------------------------------------------------
+void PgSQLConnection::Update(const std::vector<Serializable*>& _objects, std::vector<Serializable*>& _failed) anope_override
+{
+  // Rows of the same type serializing the same fields share one set-based UPDATE
+  std::map<Anope::string, std::vector<Serializable*> > batches;
+
+  for (std::vector<Serializable*>::const_iterator it = _objects.begin(); it != _objects.end(); ++it)
+  {
+    Data serialized_data;
+    (*it)->Serialize(serialized_data);
+
+    Anope::string signature = (*it)->GetSerializableType()->GetName();
+    for (Data::Map::const_iterator itData = serialized_data.data.begin(); itData != serialized_data.data.end(); ++itData)
+      signature += " " + itData->first;
+
+    batches[signature].push_back(*it);
+  }
+
+  // Bound the statement size on very large flushes
+  const size_t batchSize = 1000;
+
+  for (std::map<Anope::string, std::vector<Serializable*> >::iterator it = batches.begin(); it != batches.end(); ++it)
+  {
+    const std::vector<Serializable*>& batch = it->second;
+
+    for (size_t offset = 0; offset < batch.size(); offset += batchSize)
+    {
+      size_t end = std::min(offset + batchSize, batch.size());
+
+      Log(LOG_DEBUG) << "PGSQL::Update - " << batch.front()->GetSerializableType()->GetName() << ":" << stringify(end - offset) << " rows";
+
+      PGresult* pResult = NULL;
+      try
+      {
+        pResult = Query(BuildUpdateRowsQuery(batch.begin() + offset, batch.begin() + end));
+      }
+      catch (const Datastore::Exception& exception)
+      {
+        Log(LOG_NORMAL, "pgsql") << "PgSQL: " << exception.GetReason();
+      }
+
+      bool isUpdated = pResult && PQresultStatus(pResult) == PGRES_COMMAND_OK;
+
+      if (pResult)
+        PQclear(pResult);
+
+      if (!isUpdated)
+        _failed.insert(_failed.end(), batch.begin() + offset, batch.begin() + end);
+    }
+  }
+}
+
 //------------------------------------------------------------------------------
 void PgSQLConnection::Destroy(Serializable* _pObject) anope_override
 {
@@ -426,4 +1331,24 @@ void PgSQLConnection::Destroy(Serializable* _pObject) anope_override
     return;
   
   PQclear(pResult);
+}
+
+//------------------------------------------------------------------------------
+void PgSQLConnection::Destroy(const Anope::string& _table, const std::vector<uint64_t>& _ids) anope_override
+{
+  Log(LOG_DEBUG) << "PGSQL::Destroy - " << _table << ":" << stringify(_ids.size()) << " rows";
+
+  // Bound the statement size on very large sweeps
+  const size_t batchSize = 1000;
+
+  for (size_t offset = 0; offset < _ids.size(); offset += batchSize)
+  {
+    size_t end = std::min(offset + batchSize, _ids.size());
+    PGresult* pResult = Query(BuildDestroyRowsQuery(_table, _ids.begin() + offset, _ids.begin() + end));
+
+    if(pResult == NULL)
+      return;
+
+    PQclear(pResult);
+  }
 }
\ No newline at end of file
@@ -7,19 +7,78 @@
 #include "module.h"
 #include "datastore.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <deque>
 #include <sstream>
 #include <libpq-fe.h>
 
 using namespace Datastore;
 class PgSQLConnection;
 
+//------------------------------------------------------------------------------
+// PgSQLProfiler
+//------------------------------------------------------------------------------
+class PgSQLProfiler
+{
+ public:
+  struct Statistics
+  {
+    Anope::string fingerprint;
+    unsigned long count;
+    double totalTime;
+    double maxTime;
+    bool isExplained;
+  };
+
+ private:
+  std::map<Anope::string, Statistics> m_statistics;
+  unsigned int m_slowQueryThreshold;
+  unsigned int m_stallBudget;
+  unsigned long m_stallCount;
+
+ public:
+  PgSQLProfiler();
+
+  static Anope::string Fingerprint(const Anope::string& _rawQuery);
+  static Anope::string CollapseValues(const Anope::string& _fingerprint);
+
+  void SetSlowQueryThreshold(unsigned int _threshold) { m_slowQueryThreshold = _threshold; }
+  unsigned int GetSlowQueryThreshold() const { return m_slowQueryThreshold; }
+  void SetStallBudget(unsigned int _budget) { m_stallBudget = _budget; }
+  unsigned int GetStallBudget() const { return m_stallBudget; }
+  unsigned long GetStallCount() const { return m_stallCount; }
+
+  // Returns true when a statement blocked the event loop for longer than the stall budget
+  bool IsStall(double _elapsed);
+
+  // Returns true the first time a fingerprint exceeds the slow query threshold
+  bool Record(const Anope::string& _fingerprint, double _elapsed);
+  std::vector<Statistics> GetTop(size_t _count) const;
+  void Clear();
+};
+
+//------------------------------------------------------------------------------
+// CommandOSSQLStats
+//------------------------------------------------------------------------------
+class CommandOSSQLStats : public Command
+{
+  std::map<Anope::string, PgSQLConnection*>& m_connections;
+
+ public:
+  CommandOSSQLStats(Module* _pOwner, std::map<Anope::string, PgSQLConnection*>& _connections);
+
+  void Execute(CommandSource& _source, const std::vector<Anope::string>& _params) anope_override;
+  bool OnHelp(CommandSource& _source, const Anope::string& _subcommand) anope_override;
+};
+
 //------------------------------------------------------------------------------
 // PgSQLModule
 //------------------------------------------------------------------------------
 class PgSQLModule : public Module, public Pipe
 {
   std::map<Anope::string, PgSQLConnection*> m_connections;
+  CommandOSSQLStats m_commandOSSQLStats;
   
   public:
   
@@ -36,6 +95,17 @@ class PgSQLModule : public Module, public Pipe
 //------------------------------------------------------------------------------
 class PgSQLConnection : public Provider
 {
+ public:
+  struct PartitionPolicy
+  {
+    Anope::string interval;
+    unsigned int retention;
+    bool isEnabled;
+    Anope::string period;
+  };
+
+ private:
+
   Anope::string m_username;
   Anope::string m_password;
   Anope::string m_hostname;
@@ -44,27 +114,55 @@ class PgSQLConnection : public Provider
   Anope::string m_schema;
 
   PGconn* m_pConnection;
+  PgSQLProfiler m_profiler;
+  std::map<Anope::string, PartitionPolicy> m_partitionPolicies;
+
+  // Ids fetched ahead from each table's sequence, handed out by AllocateId
+  std::map<Anope::string, std::deque<uint64_t> > m_idBlocks;
+  std::set<Anope::string> m_missingTables;
+  unsigned int m_idBlockSize;
+  unsigned long m_idGeneration;
   
   void Connect();
   void Disconnect();
   bool isConnected();
   
   PGresult* Query(const Anope::string& _rawQuery);
+  void CheckStall(double _startTime, const Anope::string& _fingerprint);
+  void Explain(const Anope::string& _fingerprint, const Anope::string& _rawQuery);
   
   Anope::string EscapeString(const Anope::string& _rawQuery);
   Anope::string BuildCreateTableQuery(Serializable* _pObject);
+  Anope::string BuildPartitionBoundsQuery(const Anope::string& _table, const PartitionPolicy& _policy);
+  Anope::string BuildCreatePartitionQuery(const Anope::string& _table, const Anope::string& _suffix, const Anope::string& _from, const Anope::string& _to);
+  void EnsurePartitions(Serializable* _pObject);
+  Anope::string BuildAllocateIdsQuery(Serialize::Type* _pType);
   Anope::string BuildInsertRowQuery(Serializable* _pObject);
+  Anope::string BuildInsertRowsQuery(const std::vector<Serializable*>& _objects);
   Anope::string BuildUpdateRowQuery(Serializable* _pObject);
+  Anope::string BuildUpdateRowsQuery(std::vector<Serializable*>::const_iterator _begin, std::vector<Serializable*>::const_iterator _end);
   Anope::string BuildDestroyRowQuery(Serializable* _pObject);
+  Anope::string BuildDestroyRowsQuery(const Anope::string& _table, std::vector<uint64_t>::const_iterator _begin, std::vector<uint64_t>::const_iterator _end);
   
  public:
   PgSQLConnection(Module* _pOwner, const Anope::string& _name, const Anope::string& _database, const Anope::string& _hostname, const Anope::string& _username, const Anope::string& _password, const Anope::string& _port);
   ~PgSQLConnection();
 
-  void Create(Serializable* _pObject) anope_override;
+  PgSQLProfiler& GetProfiler() { return m_profiler; }
+  void Reconfigure(const Anope::string& _database, const Anope::string& _hostname, const Anope::string& _username, const Anope::string& _password, const Anope::string& _port);
+  bool IsConfiguredAs(const Anope::string& _database, const Anope::string& _hostname, const Anope::string& _username, const Anope::string& _password, const Anope::string& _port) const;
+  void SetIdBlockSize(unsigned int _size) { m_idBlockSize = _size; }
+  void SetPartitionPolicies(const std::map<Anope::string, PartitionPolicy>& _policies);
+
+  uint64_t AllocateId(Serialize::Type* _pType) anope_override;
+  unsigned long GetIdGeneration() const anope_override { return m_idGeneration; }
+  bool Create(Serializable* _pObject) anope_override;
+  void Create(const std::vector<Serializable*>& _objects, std::vector<Serializable*>& _failed) anope_override;
   void Read(Serialize::Type* _pType) anope_override;
   void Update(Serializable* _pObject) anope_override;
+  void Update(const std::vector<Serializable*>& _objects, std::vector<Serializable*>& _failed) anope_override;
   void Destroy(Serializable* _pObject) anope_override;
+  void Destroy(const Anope::string& _table, const std::vector<uint64_t>& _ids) anope_override;
 };
 
 //------------------------------------------------------------------------------
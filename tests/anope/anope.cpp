@@ -0,0 +1,328 @@
+//==============================================================================
+// File:	anope.cpp
+// Purpose: Test-only stand-in for the parts of the Anope 2.0 API used by the
+//          modules, so they can be built and run without an Anope tree
+//==============================================================================
+#include "module.h"
+
+#include <cstdlib>
+
+bool Anope::ReadOnly = false;
+time_t Anope::CurTime = time(NULL);
+std::vector<Module*> ModuleManager::Modules;
+
+namespace
+{
+  std::map<std::pair<Anope::string, Anope::string>, Service*>& GetServices()
+  {
+    static std::map<std::pair<Anope::string, Anope::string>, Service*> services;
+    return services;
+  }
+
+  std::map<Anope::string, Serialize::Type*>& GetTypes()
+  {
+    static std::map<Anope::string, Serialize::Type*> types;
+    return types;
+  }
+
+  std::set<Pipe*>& GetPipes()
+  {
+    static std::set<Pipe*> pipes;
+    return pipes;
+  }
+
+  Anope::string FormatV(const char* _pFormat, va_list _arguments)
+  {
+    char buffer[4096];
+    vsnprintf(buffer, sizeof(buffer), _pFormat, _arguments);
+    return buffer;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Anope
+//------------------------------------------------------------------------------
+Anope::string Anope::printf(const char* _pFormat, ...)
+{
+  va_list arguments;
+  va_start(arguments, _pFormat);
+  Anope::string result = FormatV(_pFormat, arguments);
+  va_end(arguments);
+
+  return result;
+}
+
+//------------------------------------------------------------------------------
+// Log
+//------------------------------------------------------------------------------
+Log::~Log()
+{
+  if (m_type >= LOG_DEBUG)
+    return;
+
+  Test::GetLog().push_back((m_category.empty() ? Anope::string("services") : m_category) + ": " + m_buffer.str());
+  if (getenv("SERVICES_TEST_VERBOSE"))
+    fprintf(stderr, "%s\n", Test::GetLog().back().c_str());
+}
+
+//------------------------------------------------------------------------------
+// Service
+//------------------------------------------------------------------------------
+Service::Service(Module* _pOwner, const Anope::string& _type, const Anope::string& _name)
+  : owner(_pOwner),
+  type(_type),
+  name(_name)
+{
+  std::pair<Anope::string, Anope::string> key(_type, _name);
+  if (GetServices().count(key))
+    throw ModuleException("Service " + _type + " with name " + _name + " already exists");
+
+  GetServices()[key] = this;
+}
+
+//------------------------------------------------------------------------------
+Service::~Service()
+{
+  GetServices().erase(std::make_pair(type, name));
+}
+
+//------------------------------------------------------------------------------
+Service* Service::FindService(const Anope::string& _type, const Anope::string& _name)
+{
+  std::map<std::pair<Anope::string, Anope::string>, Service*>::iterator it = GetServices().find(std::make_pair(_type, _name));
+  return it == GetServices().end() ? NULL : it->second;
+}
+
+//------------------------------------------------------------------------------
+// Serialize::Type
+//------------------------------------------------------------------------------
+Serialize::Type::Type(const Anope::string& _name)
+  : m_name(_name),
+  m_timestamp(0)
+{
+  GetTypes()[_name] = this;
+}
+
+//------------------------------------------------------------------------------
+Serialize::Type::~Type()
+{
+  GetTypes().erase(m_name);
+}
+
+//------------------------------------------------------------------------------
+Serialize::Type* Serialize::Type::Find(const Anope::string& _name)
+{
+  std::map<Anope::string, Type*>::iterator it = GetTypes().find(_name);
+  return it == GetTypes().end() ? NULL : it->second;
+}
+
+//------------------------------------------------------------------------------
+// Serializable
+//------------------------------------------------------------------------------
+Serializable::Serializable(const Anope::string& _type)
+  : m_pType(Serialize::Type::Find(_type)),
+  id(0)
+{
+  for (size_t i = 0; i < ModuleManager::Modules.size(); ++i)
+    ModuleManager::Modules[i]->OnSerializableConstruct(this);
+}
+
+//------------------------------------------------------------------------------
+Serializable::~Serializable()
+{
+  for (size_t i = 0; i < ModuleManager::Modules.size(); ++i)
+    ModuleManager::Modules[i]->OnSerializableDestruct(this);
+}
+
+//------------------------------------------------------------------------------
+void Serializable::QueueUpdate()
+{
+  for (size_t i = 0; i < ModuleManager::Modules.size(); ++i)
+    ModuleManager::Modules[i]->OnSerializableUpdate(this);
+}
+
+//------------------------------------------------------------------------------
+// Pipe
+//------------------------------------------------------------------------------
+Pipe::Pipe()
+  : m_isNotified(false)
+{
+  GetPipes().insert(this);
+}
+
+//------------------------------------------------------------------------------
+Pipe::~Pipe()
+{
+  GetPipes().erase(this);
+}
+
+//------------------------------------------------------------------------------
+void Pipe::Process()
+{
+  std::set<Pipe*> pipes = GetPipes();
+  for (std::set<Pipe*>::iterator it = pipes.begin(); it != pipes.end(); ++it)
+  {
+    if (!(*it)->m_isNotified)
+      continue;
+
+    (*it)->m_isNotified = false;
+    (*it)->OnNotify();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Configuration
+//------------------------------------------------------------------------------
+Configuration::Block& Configuration::Block::Set(const Anope::string& _tag, const Anope::string& _value)
+{
+  m_items[_tag] = _value;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+Configuration::Block& Configuration::Block::AddBlock(const Anope::string& _name)
+{
+  return m_blocks.insert(std::make_pair(_name, Block()))->second;
+}
+
+//------------------------------------------------------------------------------
+int Configuration::Block::CountBlock(const Anope::string& _name) const
+{
+  return static_cast<int>(m_blocks.count(_name));
+}
+
+//------------------------------------------------------------------------------
+Configuration::Block* Configuration::Block::GetBlock(const Anope::string& _name, int _index)
+{
+  // Like Anope, a missing block reads as an empty one
+  static Block empty;
+
+  std::multimap<Anope::string, Block>::iterator it = m_blocks.lower_bound(_name);
+  for (int i = 0; i < _index && it != m_blocks.end() && it->first == _name; ++i)
+    ++it;
+
+  if (it == m_blocks.end() || it->first != _name)
+    return &empty;
+
+  return &it->second;
+}
+
+//------------------------------------------------------------------------------
+Anope::string Configuration::Block::GetValue(const Anope::string& _tag, const Anope::string& _default) const
+{
+  std::map<Anope::string, Anope::string>::const_iterator it = m_items.find(_tag);
+  return it == m_items.end() ? _default : it->second;
+}
+
+//------------------------------------------------------------------------------
+template<> time_t Configuration::Block::Get<time_t>(const Anope::string& _tag, const Anope::string& _default) const
+{
+  Anope::string value = GetValue(_tag, _default);
+  if (value.empty())
+    return 0;
+
+  time_t multiplier = 1;
+  switch (value[value.length() - 1])
+  {
+  case 's': multiplier = 1; break;
+  case 'm': multiplier = 60; break;
+  case 'h': multiplier = 3600; break;
+  case 'd': multiplier = 86400; break;
+  default: return atol(value.c_str());
+  }
+
+  return atol(value.substr(0, value.length() - 1).c_str()) * multiplier;
+}
+
+//------------------------------------------------------------------------------
+Configuration::Block* Configuration::Conf::GetModule(Module* _pModule)
+{
+  return &m_modules[_pModule->name];
+}
+
+//------------------------------------------------------------------------------
+// Module
+//------------------------------------------------------------------------------
+Module::Module(const Anope::string& _name, const Anope::string&, int _type)
+  : name(_name),
+  type(_type)
+{
+  ModuleManager::Modules.push_back(this);
+}
+
+//------------------------------------------------------------------------------
+Module::~Module()
+{
+  ModuleManager::Modules.erase(std::remove(ModuleManager::Modules.begin(), ModuleManager::Modules.end(), this), ModuleManager::Modules.end());
+}
+
+//------------------------------------------------------------------------------
+Module* ModuleManager::FindFirstOf(int _type)
+{
+  for (size_t i = 0; i < Modules.size(); ++i)
+    if (Modules[i]->type & _type)
+      return Modules[i];
+
+  return NULL;
+}
+
+//------------------------------------------------------------------------------
+// Commands
+//------------------------------------------------------------------------------
+void CommandSource::Reply(const char* _pFormat, ...)
+{
+  va_list arguments;
+  va_start(arguments, _pFormat);
+  replies.push_back(FormatV(_pFormat, arguments));
+  va_end(arguments);
+}
+
+//------------------------------------------------------------------------------
+void CommandSource::Reply(const Anope::string& _message)
+{
+  replies.push_back(_message);
+}
+
+//------------------------------------------------------------------------------
+void Command::SendSyntax(CommandSource& _source)
+{
+  for (size_t i = 0; i < m_syntax.size(); ++i)
+    _source.Reply("Syntax: " + name + " " + m_syntax[i]);
+}
+
+//------------------------------------------------------------------------------
+void Command::OnSyntaxError(CommandSource& _source, const Anope::string&)
+{
+  SendSyntax(_source);
+}
+
+//------------------------------------------------------------------------------
+bool spacesepstream::GetToken(Anope::string& _token)
+{
+  std::string token;
+  if (!(m_stream >> token))
+    return false;
+
+  _token = token;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Test
+//------------------------------------------------------------------------------
+std::vector<Anope::string>& Test::GetLog()
+{
+  static std::vector<Anope::string> log;
+  return log;
+}
+
+//------------------------------------------------------------------------------
+size_t Test::CountLog(const Anope::string& _needle)
+{
+  size_t count = 0;
+  for (size_t i = 0; i < GetLog().size(); ++i)
+    if (GetLog()[i].find(_needle) != Anope::string::npos)
+      ++count;
+
+  return count;
+}
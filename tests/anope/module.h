@@ -0,0 +1,461 @@
+//==============================================================================
+// File:	module.h
+// Purpose: Test-only stand-in for the parts of the Anope 2.0 API used by the
+//          modules, so they can be built and run without an Anope tree
+//==============================================================================
+#pragma once
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#define anope_override
+#define _(x) x
+#define MODULE_INIT(x)
+
+class Command;
+class CommandSource;
+class Module;
+class Serializable;
+class User;
+
+//------------------------------------------------------------------------------
+// Anope
+//------------------------------------------------------------------------------
+namespace Anope
+{
+  class string
+  {
+    std::string m_string;
+
+   public:
+    typedef std::string::size_type size_type;
+    static const size_type npos = static_cast<size_type>(-1);
+
+    string() { }
+    string(const char* _pString) : m_string(_pString) { }
+    string(const std::string& _string) : m_string(_string) { }
+    string(char _c) : m_string(1, _c) { }
+    string(const char* _pString, size_type _length) : m_string(_pString, _length) { }
+
+    const char* c_str() const { return m_string.c_str(); }
+    const std::string& str() const { return m_string; }
+    size_type length() const { return m_string.length(); }
+    bool empty() const { return m_string.empty(); }
+
+    char& operator[](size_type _index) { return m_string[_index]; }
+    const char& operator[](size_type _index) const { return m_string[_index]; }
+
+    string& operator+=(const string& _other) { m_string += _other.m_string; return *this; }
+    string& operator+=(const char* _pOther) { m_string += _pOther; return *this; }
+    string& operator+=(char _c) { m_string += _c; return *this; }
+    string operator+(const string& _other) const { return m_string + _other.m_string; }
+    string operator+(const char* _pOther) const { return m_string + _pOther; }
+    string operator+(char _c) const { return m_string + _c; }
+    friend string operator+(const char* _pLeft, const string& _right) { return std::string(_pLeft) + _right.m_string; }
+
+    bool operator==(const string& _other) const { return m_string == _other.m_string; }
+    bool operator==(const char* _pOther) const { return m_string == _pOther; }
+    bool operator!=(const string& _other) const { return m_string != _other.m_string; }
+    bool operator!=(const char* _pOther) const { return m_string != _pOther; }
+    bool operator<(const string& _other) const { return m_string < _other.m_string; }
+
+    string substr(size_type _position, size_type _length = npos) const { return _position > length() ? string() : string(m_string.substr(_position, _length)); }
+    size_type find(const string& _needle, size_type _position = 0) const { return m_string.find(_needle.m_string, _position); }
+    size_type find(char _c, size_type _position = 0) const { return m_string.find(_c, _position); }
+    size_type find_ci(const string& _needle, size_type _position = 0) const { return lower().m_string.find(_needle.lower().m_string, _position); }
+
+    bool equals_cs(const string& _other) const { return m_string == _other.m_string; }
+    bool equals_ci(const string& _other) const { return lower() == _other.lower(); }
+
+    string lower() const
+    {
+      std::string result = m_string;
+      for (size_type i = 0; i < result.length(); ++i)
+        result[i] = tolower(static_cast<unsigned char>(result[i]));
+      return result;
+    }
+
+    string& trim(const string& _what = " \t\r\n")
+    {
+      size_type begin = m_string.find_first_not_of(_what.m_string);
+      if (begin == std::string::npos)
+      {
+        m_string.clear();
+        return *this;
+      }
+
+      m_string = m_string.substr(begin, m_string.find_last_not_of(_what.m_string) - begin + 1);
+      return *this;
+    }
+
+    bool is_pos_number_only() const
+    {
+      if (m_string.empty())
+        return false;
+      for (size_type i = 0; i < m_string.length(); ++i)
+        if (!isdigit(static_cast<unsigned char>(m_string[i])))
+          return false;
+      return true;
+    }
+
+    friend std::ostream& operator<<(std::ostream& _stream, const string& _string) { return _stream << _string.m_string; }
+    friend std::istream& operator>>(std::istream& _stream, string& _string) { return _stream >> _string.m_string; }
+  };
+
+  struct hash_cs
+  {
+    size_t operator()(const string& _string) const
+    {
+      size_t hash = 5381;
+      for (string::size_type i = 0; i < _string.length(); ++i)
+        hash = hash * 33 + static_cast<unsigned char>(_string[i]);
+      return hash;
+    }
+  };
+
+  extern bool ReadOnly;
+  extern time_t CurTime;
+
+  string printf(const char* _pFormat, ...);
+}
+
+//------------------------------------------------------------------------------
+template<typename T> Anope::string stringify(const T& _value)
+{
+  std::stringstream stream;
+  stream << _value;
+  return stream.str();
+}
+
+class ConvertException { };
+
+template<typename T> T convertTo(const Anope::string& _string)
+{
+  std::istringstream stream(_string.str());
+  T value;
+  char left;
+  if (!(stream >> value) || stream.get(left))
+    throw ConvertException();
+  return value;
+}
+
+//------------------------------------------------------------------------------
+// Exceptions
+//------------------------------------------------------------------------------
+class CoreException
+{
+  Anope::string m_reason;
+
+ public:
+  CoreException(const Anope::string& _reason) : m_reason(_reason) { }
+  virtual ~CoreException() throw() { }
+
+  const Anope::string& GetReason() const { return m_reason; }
+};
+
+class ModuleException : public CoreException
+{
+ public:
+  ModuleException(const Anope::string& _reason) : CoreException(_reason) { }
+  virtual ~ModuleException() throw() { }
+};
+
+//------------------------------------------------------------------------------
+// Log - lines are kept for the tests to inspect instead of being written out
+//------------------------------------------------------------------------------
+enum LogType { LOG_TERMINAL, LOG_ADMIN, LOG_NORMAL, LOG_DEBUG, LOG_DEBUG_2 };
+
+class Log
+{
+  LogType m_type;
+  Anope::string m_category;
+  std::stringstream m_buffer;
+
+ public:
+  Log(LogType _type = LOG_NORMAL, const Anope::string& _category = "") : m_type(_type), m_category(_category) { }
+  Log(LogType _type, CommandSource&, Command*) : m_type(_type), m_category("command") { }
+  ~Log();
+
+  template<typename T> Log& operator<<(const T& _value)
+  {
+    m_buffer << _value;
+    return *this;
+  }
+};
+
+//------------------------------------------------------------------------------
+// Services
+//------------------------------------------------------------------------------
+class Base
+{
+ public:
+  virtual ~Base() { }
+};
+
+class Service : public virtual Base
+{
+ public:
+  Module* owner;
+  Anope::string type;
+  Anope::string name;
+
+  Service(Module* _pOwner, const Anope::string& _type, const Anope::string& _name);
+  virtual ~Service();
+
+  static Service* FindService(const Anope::string& _type, const Anope::string& _name);
+};
+
+template<typename T> class ServiceReference
+{
+  Anope::string m_type;
+  Anope::string m_name;
+
+ public:
+  ServiceReference() { }
+  ServiceReference(const Anope::string& _type, const Anope::string& _name) : m_type(_type), m_name(_name) { }
+
+  T* Get() const { return dynamic_cast<T*>(Service::FindService(m_type, m_name)); }
+  operator bool() const { return Get() != NULL; }
+  T* operator->() const { return Get(); }
+  T* operator*() const { return Get(); }
+};
+
+//------------------------------------------------------------------------------
+// Serialization
+//------------------------------------------------------------------------------
+namespace Serialize
+{
+  class Data
+  {
+   public:
+    enum Type { DT_TEXT, DT_INT };
+
+    virtual ~Data() { }
+    virtual std::iostream& operator[](const Anope::string& _key) = 0;
+    virtual std::set<Anope::string> KeySet() const = 0;
+    virtual size_t Hash() const = 0;
+    virtual void SetType(const Anope::string& _key, Type _type) = 0;
+    virtual Type GetType(const Anope::string& _key) const = 0;
+  };
+
+  class Type : public virtual Base
+  {
+    Anope::string m_name;
+    time_t m_timestamp;
+
+   public:
+    std::map<uint64_t, Serializable*> objects;
+
+    Type(const Anope::string& _name);
+    ~Type();
+
+    const Anope::string& GetName() const { return m_name; }
+    void UpdateTimestamp() { m_timestamp = Anope::CurTime; }
+    time_t GetTimestamp() const { return m_timestamp; }
+    Serializable* Unserialize(Serializable* _pObject, Data&) { return _pObject; }
+
+    static Type* Find(const Anope::string& _name);
+  };
+}
+
+class Serializable : public virtual Base
+{
+  Serialize::Type* m_pType;
+
+ public:
+  uint64_t id;
+
+  Serializable(const Anope::string& _type);
+  virtual ~Serializable();
+
+  // Stands in for Anope's QueueUpdate, which raises OnSerializableUpdate
+  void QueueUpdate();
+
+  Serialize::Type* GetSerializableType() const { return m_pType; }
+  void UpdateTS() { }
+  bool IsTSCached() { return false; }
+
+  virtual void Serialize(Serialize::Data& _data) const = 0;
+};
+
+//------------------------------------------------------------------------------
+// Event loop
+//------------------------------------------------------------------------------
+class Timer
+{
+  time_t m_secs;
+  bool m_isRepeating;
+
+ public:
+  Timer(Module*, time_t _secs, time_t = 0, bool _isRepeating = true) : m_secs(_secs), m_isRepeating(_isRepeating) { }
+  virtual ~Timer() { }
+
+  virtual void Tick(time_t _now) = 0;
+  void SetSecs(time_t _secs) { m_secs = _secs; }
+  time_t GetSecs() const { return m_secs; }
+};
+
+class Pipe
+{
+  bool m_isNotified;
+
+ public:
+  Pipe();
+  virtual ~Pipe();
+
+  void Notify() { m_isNotified = true; }
+  virtual void OnNotify() = 0;
+
+  // Runs OnNotify on every notified pipe, as one pass of the event loop would
+  static void Process();
+};
+
+//------------------------------------------------------------------------------
+// Configuration
+//------------------------------------------------------------------------------
+namespace Configuration
+{
+  class Block
+  {
+    std::map<Anope::string, Anope::string> m_items;
+    std::multimap<Anope::string, Block> m_blocks;
+
+   public:
+    template<typename T> T Get(const Anope::string& _tag, const Anope::string& _default = "") const
+    {
+      try
+      {
+        return convertTo<T>(GetValue(_tag, _default));
+      }
+      catch (const ConvertException &)
+      {
+        return T();
+      }
+    }
+
+    Block& Set(const Anope::string& _tag, const Anope::string& _value);
+    Block& AddBlock(const Anope::string& _name);
+    int CountBlock(const Anope::string& _name) const;
+    Block* GetBlock(const Anope::string& _name, int _index);
+
+   private:
+    Anope::string GetValue(const Anope::string& _tag, const Anope::string& _default) const;
+  };
+
+  template<> inline const Anope::string Block::Get<const Anope::string>(const Anope::string& _tag, const Anope::string& _default) const
+  {
+    return GetValue(_tag, _default);
+  }
+
+  template<> inline Anope::string Block::Get<Anope::string>(const Anope::string& _tag, const Anope::string& _default) const
+  {
+    return GetValue(_tag, _default);
+  }
+
+  // Durations accept the s, m, h and d suffixes
+  template<> time_t Block::Get<time_t>(const Anope::string& _tag, const Anope::string& _default) const;
+
+  class Conf
+  {
+    std::map<Anope::string, Block> m_modules;
+
+   public:
+    Block* GetModule(Module* _pModule);
+    Block& GetModule(const Anope::string& _name) { return m_modules[_name]; }
+  };
+}
+
+//------------------------------------------------------------------------------
+// Modules
+//------------------------------------------------------------------------------
+enum EventReturn { EVENT_STOP, EVENT_CONTINUE, EVENT_ALLOW };
+enum ModType { EXTRA = 1, DATABASE = 2, ENCRYPTION = 4, PROTOCOL = 8, VENDOR = 16, THIRD = 32 };
+
+class Extensible { };
+
+class Module : public Extensible
+{
+ public:
+  Anope::string name;
+  int type;
+
+  Module(const Anope::string& _name, const Anope::string& _creator, int _type);
+  virtual ~Module();
+
+  virtual EventReturn OnLoadDatabase() { return EVENT_CONTINUE; }
+  virtual void OnShutdown() { }
+  virtual void OnRestart() { }
+  virtual void OnReload(Configuration::Conf*) { }
+  virtual void OnModuleUnload(User*, Module*) { }
+  virtual void OnSerializableConstruct(Serializable*) { }
+  virtual void OnSerializeCheck(Serialize::Type*) { }
+  virtual void OnSerializableUpdate(Serializable*) { }
+  virtual void OnSerializableDestruct(Serializable*) { }
+};
+
+struct ModuleManager
+{
+  static std::vector<Module*> Modules;
+
+  static Module* FindFirstOf(int _type);
+};
+
+//------------------------------------------------------------------------------
+// Commands
+//------------------------------------------------------------------------------
+class CommandSource
+{
+ public:
+  std::vector<Anope::string> replies;
+
+  void Reply(const char* _pFormat, ...);
+  void Reply(const Anope::string& _message);
+};
+
+class Command : public Service
+{
+  Anope::string m_description;
+  std::vector<Anope::string> m_syntax;
+
+ public:
+  Command(Module* _pOwner, const Anope::string& _name, size_t, size_t = 0) : Service(_pOwner, "Command", _name) { }
+
+  void SetDesc(const Anope::string& _description) { m_description = _description; }
+  void SetSyntax(const Anope::string& _syntax) { m_syntax.push_back(_syntax); }
+  void SendSyntax(CommandSource& _source);
+
+  virtual void Execute(CommandSource& _source, const std::vector<Anope::string>& _params) = 0;
+  virtual bool OnHelp(CommandSource&, const Anope::string&) { return false; }
+  virtual void OnSyntaxError(CommandSource& _source, const Anope::string& _subcommand);
+};
+
+//------------------------------------------------------------------------------
+class spacesepstream
+{
+  std::istringstream m_stream;
+
+ public:
+  spacesepstream(const Anope::string& _source) : m_stream(_source.str()) { }
+
+  bool GetToken(Anope::string& _token);
+};
+
+//------------------------------------------------------------------------------
+// Test - inspection hooks with no Anope counterpart
+//------------------------------------------------------------------------------
+namespace Test
+{
+  // Non-debug log lines, as "category: message"
+  std::vector<Anope::string>& GetLog();
+  size_t CountLog(const Anope::string& _needle);
+}
@@ -0,0 +1,295 @@
+//==============================================================================
+// File:	dbsql_test.cpp
+// Purpose: db_sql write scheduling through m_pgsql and the wire protocol
+//          stand-in, including an event loop held to the stall budget
+//==============================================================================
+#include "test.h"
+#include "db_sql.h"
+
+namespace
+{
+  //----------------------------------------------------------------------------
+  // DBSQLEnvironment - db_sql loaded on top of a configured m_pgsql
+  //----------------------------------------------------------------------------
+  class DBSQLEnvironment : public PgSQLEnvironment
+  {
+   public:
+    DBSQL* pDBSQL;
+    std::vector<TestRecord*> records;
+
+    DBSQLEnvironment()
+      : pDBSQL(NULL)
+    {
+      Configuration::Block& block = config.GetModule("db_sql");
+      block.Set("engine", "pgsql/main");
+      block.AddBlock("defer").Set("type", "TestRecord").Set("fields", "last_seen");
+
+      pDBSQL = new DBSQL("db_sql", "test");
+      pDBSQL->OnReload(&config);
+      pDBSQL->OnLoadDatabase();
+
+      // The first insert creates the table, later ones can draw preallocated ids
+      Create(1);
+    }
+
+    ~DBSQLEnvironment()
+    {
+      for (size_t i = 0; i < records.size(); ++i)
+        delete records[i];
+
+      delete pDBSQL;
+    }
+
+    void Create(size_t _count)
+    {
+      for (size_t i = 0; i < _count; ++i)
+        records.push_back(new TestRecord("nick" + stringify(records.size())));
+
+      Pipe::Process();
+    }
+
+    void Destroy(size_t _count)
+    {
+      for (size_t i = 0; i < _count && !records.empty(); ++i)
+      {
+        delete records.back();
+        records.pop_back();
+      }
+
+      Pipe::Process();
+    }
+  };
+}
+
+//------------------------------------------------------------------------------
+void TestCreatesShareStatement()
+{
+  DBSQLEnvironment environment;
+  environment.server.ClearStatements();
+
+  environment.Create(200);
+
+  CHECK(environment.server.CountStatements("INSERT") == 1);
+  CHECK(environment.pDBSQL->GetPendingCount(DBSQL::CRITICAL) == 0);
+  CHECK(environment.type.objects.size() == environment.records.size());
+
+  bool isRegistered = true;
+  for (size_t i = 0; i < environment.records.size(); ++i)
+    isRegistered = isRegistered && environment.records[i]->id != 0 && environment.type.objects[environment.records[i]->id] == environment.records[i];
+  CHECK(isRegistered);
+}
+
+//------------------------------------------------------------------------------
+void TestDeferredFlushIsSetBased()
+{
+  DBSQLEnvironment environment;
+  environment.Create(300);
+  environment.server.ClearStatements();
+
+  for (size_t i = 0; i < environment.records.size(); ++i)
+  {
+    environment.records[i]->lastSeen = "now";
+    environment.records[i]->QueueUpdate();
+  }
+  Pipe::Process();
+
+  CHECK(environment.server.CountStatements("UPDATE") == 0);
+  CHECK(environment.pDBSQL->GetPendingCount(DBSQL::DEFERRED) == environment.records.size());
+
+  environment.pDBSQL->FlushDeferred();
+
+  std::vector<std::string> statements = environment.server.GetStatements();
+  CHECK(statements.size() == 1 && statements[0].find("FROM (VALUES") != std::string::npos);
+  CHECK(environment.pDBSQL->GetPendingCount(DBSQL::DEFERRED) == 0);
+  CHECK(environment.pDBSQL->GetQueueStatistics(DBSQL::DEFERRED).writes == environment.records.size());
+
+  // A change outside the deferred fields is written right away
+  environment.records[0]->nick = "renamed";
+  environment.records[0]->QueueUpdate();
+  Pipe::Process();
+
+  CHECK(environment.server.CountStatements("UPDATE") == 2);
+  CHECK(environment.pDBSQL->GetPendingCount(DBSQL::DEFERRED) == 0);
+}
+
+//------------------------------------------------------------------------------
+void TestDeletesShareStatement()
+{
+  DBSQLEnvironment environment;
+  environment.Create(100);
+  environment.server.ClearStatements();
+
+  environment.Destroy(100);
+
+  CHECK(environment.server.CountStatements("DELETE") == 1);
+  CHECK(environment.type.objects.size() == environment.records.size());
+}
+
+//------------------------------------------------------------------------------
+void TestFailedInsertGivesUp()
+{
+  DBSQLEnvironment environment;
+
+  PgWireServer::Faults faults;
+  faults.errorRate = 100;
+  faults.match = "INSERT";
+  environment.server.SetFaults(faults);
+  environment.server.ClearStatements();
+
+  size_t givingUp = Test::CountLog("giving up");
+  environment.Create(1);
+  TestRecord* pRecord = environment.records.back();
+
+  // Retries wait out their backoff on the event loop clock
+  environment.pDBSQL->OnNotify();
+  CHECK(environment.server.CountStatements("INSERT") == 1);
+
+  for (int i = 0; i < 10; ++i)
+  {
+    Anope::CurTime += 60;
+    environment.pDBSQL->OnNotify();
+  }
+
+  CHECK(environment.server.CountStatements("INSERT") == 5);
+  CHECK(environment.pDBSQL->GetPendingCount(DBSQL::CRITICAL) == 0);
+  CHECK(Test::CountLog("giving up") - givingUp == 1);
+  CHECK(pRecord->id == 0);
+
+  // The next change queues a fresh insert
+  environment.server.SetFaults(PgWireServer::Faults());
+  pRecord->QueueUpdate();
+  Pipe::Process();
+
+  CHECK(pRecord->id != 0 && environment.type.objects[pRecord->id] == pRecord);
+  CHECK(environment.pDBSQL->GetPendingCount(DBSQL::CRITICAL) == 0);
+}
+
+//------------------------------------------------------------------------------
+void TestReconfigureReleasesIds()
+{
+  DBSQLEnvironment environment;
+  PgWireServer replacement(100000);
+
+  PgWireServer::Faults faults;
+  faults.errorRate = 100;
+  faults.match = "INSERT";
+  environment.server.SetFaults(faults);
+
+  environment.Create(3);
+  std::set<uint64_t> staleIds;
+  for (size_t i = 1; i < environment.records.size(); ++i)
+    staleIds.insert(environment.records[i]->id);
+  CHECK(staleIds.size() == 3 && !staleIds.count(0));
+
+  // The pending inserts carry ids drawn from the old server's sequence
+  environment.Reload(replacement);
+  Anope::CurTime += 60;
+  environment.pDBSQL->OnNotify();
+
+  CHECK(environment.pDBSQL->GetPendingCount(DBSQL::CRITICAL) == 0);
+  CHECK(replacement.CountStatements("INSERT") == 3);
+
+  bool isReassigned = true;
+  for (size_t i = 1; i < environment.records.size(); ++i)
+  {
+    TestRecord* pRecord = environment.records[i];
+    isReassigned = isReassigned && pRecord->id >= 100000 && environment.type.objects[pRecord->id] == pRecord;
+  }
+  CHECK(isReassigned);
+
+  for (std::set<uint64_t>::iterator it = staleIds.begin(); it != staleIds.end(); ++it)
+    CHECK(environment.type.objects.count(*it) == 0);
+
+  std::vector<std::string> statements = replacement.GetStatements();
+  for (size_t i = 0; i < statements.size(); ++i)
+    if (statements[i].compare(0, 6, "INSERT") == 0)
+      CHECK(statements[i].find("RETURNING") != std::string::npos);
+}
+
+//------------------------------------------------------------------------------
+void TestEventLoopWithinBudget()
+{
+  DBSQLEnvironment environment;
+  environment.Create(50);
+
+  // Slow, lossy and flaky, but never slower per statement than the budget allows
+  PgWireServer::Faults faults;
+  faults.latency = 1;
+  faults.errorRate = 5;
+  faults.dropRate = 2;
+  faults.seed = 42;
+  environment.server.SetFaults(faults);
+
+  const unsigned int budget = environment.GetConnection()->GetProfiler().GetStallBudget();
+  unsigned long queries = environment.server.GetQueryCount();
+  std::vector<double> times;
+  double startTime = Datastore::GetTime();
+
+  for (int iteration = 0; iteration < 100; ++iteration)
+  {
+    double iterationStart = Datastore::GetTime();
+    Anope::CurTime += 1;
+
+    environment.Create(10);
+
+    for (size_t i = 0; i < 20; ++i)
+    {
+      TestRecord* pRecord = environment.records[(iteration * 20 + i) % environment.records.size()];
+      pRecord->lastSeen = "seen" + stringify(iteration);
+      pRecord->QueueUpdate();
+    }
+
+    for (size_t i = 0; i < 5; ++i)
+    {
+      TestRecord* pRecord = environment.records[(iteration * 7 + i * 13) % environment.records.size()];
+      pRecord->flags++;
+      pRecord->QueueUpdate();
+    }
+
+    environment.Destroy(2);
+
+    // The flush timer, at one tick every ten iterations
+    if (iteration % 10 == 9)
+      environment.pDBSQL->FlushDeferred();
+
+    times.push_back(Datastore::GetTime() - iterationStart);
+  }
+
+  double elapsed = Datastore::GetTime() - startTime;
+
+  // The assertion the stall budget stands for: no pass of the loop blocked longer than it
+  CHECK(Test::Percentile(times, 100) <= budget);
+
+  printf("  %lu queries in %.0fms, loop p50=%.1fms p99=%.1fms max=%.1fms (budget %ums)\n", environment.server.GetQueryCount() - queries, elapsed, Test::Percentile(times, 50), Test::Percentile(times, 99), Test::Percentile(times, 100), budget);
+
+  // Once the server recovers everything still alive reaches it
+  environment.server.SetFaults(PgWireServer::Faults());
+  for (size_t i = 0; i < environment.records.size(); ++i)
+    if (environment.records[i]->id == 0)
+      environment.records[i]->QueueUpdate();
+
+  Anope::CurTime += 600;
+  environment.pDBSQL->OnNotify();
+  environment.pDBSQL->FlushDeferred();
+
+  CHECK(environment.pDBSQL->GetPendingCount(DBSQL::CRITICAL) == 0);
+  CHECK(environment.pDBSQL->GetPendingCount(DBSQL::DEFERRED) == 0);
+
+  bool isRegistered = true;
+  for (size_t i = 0; i < environment.records.size(); ++i)
+    isRegistered = isRegistered && environment.records[i]->id != 0 && environment.type.objects[environment.records[i]->id] == environment.records[i];
+  CHECK(isRegistered);
+}
+
+//------------------------------------------------------------------------------
+int main()
+{
+  RUN(TestCreatesShareStatement);
+  RUN(TestDeferredFlushIsSetBased);
+  RUN(TestDeletesShareStatement);
+  RUN(TestFailedInsertGivesUp);
+  RUN(TestReconfigureReleasesIds);
+  RUN(TestEventLoopWithinBudget);
+
+  return Test::Summary();
+}
@@ -0,0 +1,241 @@
+//==============================================================================
+// File:	pgsql_test.cpp
+// Purpose: m_pgsql against the wire protocol stand-in: batching, latency,
+//          stall budget, errors and dropped connections
+//==============================================================================
+#include "test.h"
+
+namespace
+{
+  // Creates records and gives them preallocated ids, creating the table first
+  std::vector<Serializable*> Prepare(PgSQLEnvironment& _environment, std::vector<TestRecord*>& _records, size_t _count)
+  {
+    PgSQLConnection* pConnection = _environment.GetConnection();
+
+    if (_environment.type.objects.empty())
+    {
+      TestRecord* pFirst = new TestRecord("first");
+      CHECK(pConnection->Create(pFirst));
+      _environment.type.objects[pFirst->id] = pFirst;
+      _records.push_back(pFirst);
+    }
+
+    std::vector<Serializable*> objects;
+    for (size_t i = 0; i < _count; ++i)
+    {
+      TestRecord* pRecord = new TestRecord("nick" + stringify(_records.size()));
+      pRecord->id = pConnection->AllocateId(&_environment.type);
+      _records.push_back(pRecord);
+      objects.push_back(pRecord);
+    }
+
+    return objects;
+  }
+
+  void Release(std::vector<TestRecord*>& _records)
+  {
+    for (size_t i = 0; i < _records.size(); ++i)
+      delete _records[i];
+    _records.clear();
+  }
+}
+
+//------------------------------------------------------------------------------
+void TestFingerprint()
+{
+  Anope::string single = PgSQLProfiler::Fingerprint("INSERT INTO \"T\" (\"a\", \"b\") VALUES ('x', 1); ");
+  Anope::string multiple = PgSQLProfiler::Fingerprint("INSERT INTO \"T\" (\"a\", \"b\") VALUES ('x', 1), ('it''s', 2),  ('z', 3); ");
+
+  CHECK(single == multiple);
+  CHECK(single == "INSERT INTO \"T\" (\"a\", \"b\") VALUES (?, ?);");
+
+  Anope::string update = PgSQLProfiler::Fingerprint("UPDATE \"T\" SET \"a\" = v.\"a\" FROM (VALUES (1, 'x'), (2, 'y')) AS v(\"id\", \"a\") WHERE \"T\".\"id\" = v.\"id\"; ");
+  CHECK(update == PgSQLProfiler::Fingerprint("UPDATE \"T\" SET \"a\" = v.\"a\" FROM (VALUES (7, 'q')) AS v(\"id\", \"a\") WHERE \"T\".\"id\" = v.\"id\"; "));
+  CHECK(update.find("v(\"id\", \"a\")") != Anope::string::npos);
+
+  CHECK(PgSQLProfiler::Fingerprint("SELECT 1 FROM \"T2\" WHERE x = 'a b'") == "SELECT ? FROM \"T2\" WHERE x = ?");
+}
+
+//------------------------------------------------------------------------------
+void TestBatchedCreateThroughput()
+{
+  PgSQLEnvironment environment;
+  std::vector<TestRecord*> records;
+  std::vector<Serializable*> objects = Prepare(environment, records, 1000);
+
+  PgWireServer::Faults faults;
+  faults.latency = 2;
+  environment.server.SetFaults(faults);
+  environment.server.ClearStatements();
+  unsigned long queries = environment.server.GetQueryCount();
+
+  double startTime = Datastore::GetTime();
+  std::vector<Serializable*> failed;
+  environment.GetConnection()->Create(objects, failed);
+  double elapsed = Datastore::GetTime() - startTime;
+
+  CHECK(failed.empty());
+  CHECK(environment.server.CountStatements("INSERT") == 1);
+  CHECK(environment.server.GetQueryCount() - queries == 1);
+
+  // One round trip for the whole batch, not one per row
+  CHECK(elapsed < objects.size() * faults.latency);
+
+  printf("  %lu rows in %.1fms (%.0f rows/s)\n", static_cast<unsigned long>(objects.size()), elapsed, objects.size() * 1000.0 / elapsed);
+
+  Release(records);
+}
+
+//------------------------------------------------------------------------------
+void TestLatencyWithinBudget()
+{
+  PgSQLEnvironment environment;
+  std::vector<TestRecord*> records;
+  std::vector<Serializable*> objects = Prepare(environment, records, 200);
+
+  std::vector<Serializable*> failed;
+  environment.GetConnection()->Create(objects, failed);
+
+  PgWireServer::Faults faults;
+  faults.latency = 5;
+  environment.server.SetFaults(faults);
+
+  std::vector<double> times;
+  for (size_t i = 0; i < objects.size(); ++i)
+  {
+    double startTime = Datastore::GetTime();
+    environment.GetConnection()->Update(objects[i]);
+    times.push_back(Datastore::GetTime() - startTime);
+  }
+
+  PgSQLProfiler& profiler = environment.GetConnection()->GetProfiler();
+  CHECK(Test::Percentile(times, 100) <= profiler.GetStallBudget());
+  CHECK(Test::Percentile(times, 50) >= faults.latency);
+  CHECK(profiler.GetStallCount() == 0);
+
+  printf("  update p50=%.1fms p99=%.1fms max=%.1fms\n", Test::Percentile(times, 50), Test::Percentile(times, 99), Test::Percentile(times, 100));
+
+  Release(records);
+}
+
+//------------------------------------------------------------------------------
+void TestStallBudgetCountsStalls()
+{
+  PgSQLEnvironment environment(100);
+  std::vector<TestRecord*> records;
+  std::vector<Serializable*> objects = Prepare(environment, records, 3);
+
+  // Each answer stops halfway for longer than the budget
+  PgWireServer::Faults faults;
+  faults.stallRate = 100;
+  faults.stallTime = 150;
+  environment.server.SetFaults(faults);
+
+  size_t stalls = Test::CountLog("blocked the event loop");
+  for (size_t i = 0; i < objects.size(); ++i)
+  {
+    double startTime = Datastore::GetTime();
+    environment.GetConnection()->Update(objects[i]);
+    CHECK(Datastore::GetTime() - startTime > 100);
+  }
+
+  CHECK(environment.GetConnection()->GetProfiler().GetStallCount() == objects.size());
+  CHECK(Test::CountLog("blocked the event loop") - stalls == objects.size());
+
+  Command* pCommand = dynamic_cast<Command*>(Service::FindService("Command", "operserv/sqlstats"));
+  CommandSource source;
+  pCommand->Execute(source, std::vector<Anope::string>());
+  CHECK(!source.replies.empty() && source.replies[0].find("(3 over the 100ms stall budget)") != Anope::string::npos);
+
+  Release(records);
+}
+
+//------------------------------------------------------------------------------
+void TestErrorsAreReproducible()
+{
+  PgSQLEnvironment environment;
+  std::vector<TestRecord*> records;
+
+  PgWireServer::Faults faults;
+  faults.errorRate = 50;
+  faults.match = "INSERT";
+  faults.seed = 3;
+
+  size_t failures[2];
+  for (int run = 0; run < 2; ++run)
+  {
+    std::vector<Serializable*> objects = Prepare(environment, records, 100);
+    environment.server.SetFaults(faults);
+
+    // The batch fails as a whole and falls back to single rows
+    std::vector<Serializable*> failed;
+    environment.GetConnection()->Create(objects, failed);
+    failures[run] = failed.size();
+
+    CHECK(!failed.empty() && failed.size() < objects.size());
+
+    environment.server.SetFaults(PgWireServer::Faults());
+    std::vector<Serializable*> retried;
+    environment.GetConnection()->Create(failed, retried);
+    CHECK(retried.empty());
+  }
+
+  CHECK(failures[0] == failures[1]);
+
+  printf("  seed %u failed %lu of 100 rows, twice\n", faults.seed, static_cast<unsigned long>(failures[0]));
+
+  Release(records);
+}
+
+//------------------------------------------------------------------------------
+void TestDroppedConnectionsReconnect()
+{
+  PgSQLEnvironment environment;
+  std::vector<TestRecord*> records;
+  std::vector<Serializable*> objects = Prepare(environment, records, 100);
+
+  std::vector<Serializable*> failed;
+  environment.GetConnection()->Create(objects, failed);
+
+  PgWireServer::Faults faults;
+  faults.latency = 1;
+  faults.dropRate = 30;
+  faults.seed = 3;
+  environment.server.SetFaults(faults);
+
+  unsigned long connections = environment.server.GetConnectionCount();
+  std::vector<double> times;
+  for (size_t i = 0; i < objects.size(); ++i)
+  {
+    double startTime = Datastore::GetTime();
+    environment.GetConnection()->Update(objects[i]);
+    times.push_back(Datastore::GetTime() - startTime);
+  }
+
+  // A drop costs the statement; the next one reconnects without blocking past the budget
+  CHECK(environment.server.GetConnectionCount() > connections);
+  CHECK(Test::Percentile(times, 100) <= environment.GetConnection()->GetProfiler().GetStallBudget());
+
+  environment.server.SetFaults(PgWireServer::Faults());
+  environment.server.ClearStatements();
+  environment.GetConnection()->Update(objects[0]);
+  environment.GetConnection()->Update(objects[1]);
+  CHECK(environment.server.CountStatements("UPDATE") == 2);
+
+  printf("  %lu reconnects, update max=%.1fms\n", environment.server.GetConnectionCount() - connections, Test::Percentile(times, 100));
+
+  Release(records);
+}
+
+//------------------------------------------------------------------------------
+int main()
+{
+  RUN(TestFingerprint);
+  RUN(TestBatchedCreateThroughput);
+  RUN(TestLatencyWithinBudget);
+  RUN(TestStallBudgetCountsStalls);
+  RUN(TestErrorsAreReproducible);
+  RUN(TestDroppedConnectionsReconnect);
+
+  return Test::Summary();
+}
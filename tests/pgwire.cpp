@@ -0,0 +1,684 @@
+//==============================================================================
+// File:	pgwire.cpp
+// Purpose: In-process PostgreSQL wire protocol stand-in with fault injection
+//==============================================================================
+#include "pgwire.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+  const uint32_t PROTOCOL_VERSION = 196608;
+  const uint32_t SSL_REQUEST = 80877103;
+  const uint32_t GSS_REQUEST = 80877104;
+
+  const uint32_t INT8OID = 20;
+  const uint32_t INT4OID = 23;
+  const uint32_t TEXTOID = 25;
+
+  //----------------------------------------------------------------------------
+  void PutInt32(std::string& _buffer, uint32_t _value)
+  {
+    uint32_t value = htonl(_value);
+    _buffer.append(reinterpret_cast<const char*>(&value), 4);
+  }
+
+  //----------------------------------------------------------------------------
+  void PutInt16(std::string& _buffer, uint16_t _value)
+  {
+    uint16_t value = htons(_value);
+    _buffer.append(reinterpret_cast<const char*>(&value), 2);
+  }
+
+  //----------------------------------------------------------------------------
+  uint32_t GetInt32(const std::string& _buffer, size_t _offset)
+  {
+    uint32_t value;
+    memcpy(&value, _buffer.data() + _offset, 4);
+    return ntohl(value);
+  }
+
+  //----------------------------------------------------------------------------
+  std::string Message(char _type, const std::string& _payload)
+  {
+    std::string message(1, _type);
+    PutInt32(message, _payload.length() + 4);
+    return message + _payload;
+  }
+
+  //----------------------------------------------------------------------------
+  std::string ParameterStatus(const char* _pName, const char* _pValue)
+  {
+    std::string payload = _pName;
+    payload += '\0';
+    payload += _pValue;
+    payload += '\0';
+    return Message('S', payload);
+  }
+
+  //----------------------------------------------------------------------------
+  std::string RowDescription(const char* _pColumn, uint32_t _typeOid)
+  {
+    std::string payload;
+    PutInt16(payload, 1);
+    payload += _pColumn;
+    payload += '\0';
+    PutInt32(payload, 0);
+    PutInt16(payload, 0);
+    PutInt32(payload, _typeOid);
+    PutInt16(payload, _typeOid == INT8OID ? 8 : _typeOid == INT4OID ? 4 : 0xffff);
+    PutInt32(payload, 0xffffffff);
+    PutInt16(payload, 0);
+    return Message('T', payload);
+  }
+
+  //----------------------------------------------------------------------------
+  std::string DataRow(const std::string& _value)
+  {
+    std::string payload;
+    PutInt16(payload, 1);
+    PutInt32(payload, _value.length());
+    payload += _value;
+    return Message('D', payload);
+  }
+
+  //----------------------------------------------------------------------------
+  std::string CommandComplete(const std::string& _tag)
+  {
+    return Message('C', _tag + '\0');
+  }
+
+  //----------------------------------------------------------------------------
+  std::string ErrorResponse(const char* _pCode, const std::string& _message)
+  {
+    std::string payload;
+    payload += 'S';
+    payload += "ERROR";
+    payload += '\0';
+    payload += 'V';
+    payload += "ERROR";
+    payload += '\0';
+    payload += 'C';
+    payload += _pCode;
+    payload += '\0';
+    payload += 'M';
+    payload += _message;
+    payload += '\0';
+    payload += '\0';
+    return Message('E', payload);
+  }
+
+  //----------------------------------------------------------------------------
+  std::string Trim(const std::string& _string)
+  {
+    size_t begin = _string.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+      return "";
+    return _string.substr(begin, _string.find_last_not_of(" \t\r\n") - begin + 1);
+  }
+
+  //----------------------------------------------------------------------------
+  std::vector<std::string> SplitStatements(const std::string& _query)
+  {
+    std::vector<std::string> statements;
+    std::string statement;
+    char quote = 0;
+
+    for (size_t i = 0; i < _query.length(); ++i)
+    {
+      char c = _query[i];
+
+      if (quote)
+      {
+        if (c == quote)
+          quote = 0;
+      }
+      else if (c == '\'' || c == '"')
+        quote = c;
+      else if (c == ';')
+      {
+        if (!Trim(statement).empty())
+          statements.push_back(Trim(statement));
+        statement.clear();
+        continue;
+      }
+
+      statement += c;
+    }
+
+    if (!Trim(statement).empty())
+      statements.push_back(Trim(statement));
+
+    return statements;
+  }
+
+  //----------------------------------------------------------------------------
+  std::string FirstIdentifier(const std::string& _statement)
+  {
+    size_t begin = _statement.find('"');
+    if (begin == std::string::npos)
+      return "";
+
+    size_t end = _statement.find('"', begin + 1);
+    return _statement.substr(begin + 1, end - begin - 1);
+  }
+
+  //----------------------------------------------------------------------------
+  // Counts the (...) rows of the first VALUES list, skipping quoted text
+  size_t CountValueRows(const std::string& _statement)
+  {
+    size_t position = _statement.find("VALUES");
+    if (position == std::string::npos)
+      return 0;
+
+    size_t rows = 0;
+    int depth = 0;
+    char quote = 0;
+
+    for (position += 6; position < _statement.length(); ++position)
+    {
+      char c = _statement[position];
+
+      if (quote)
+      {
+        if (c == quote)
+          quote = 0;
+        continue;
+      }
+
+      if (c == '\'' || c == '"')
+        quote = c;
+      else if (c == '(')
+        ++depth;
+      else if (c == ')' && --depth == 0)
+        ++rows;
+      else if (depth == 0 && c != ',' && c != ' ')
+        break;
+    }
+
+    return rows;
+  }
+
+  //----------------------------------------------------------------------------
+  size_t CountArrayItems(const std::string& _statement)
+  {
+    size_t begin = _statement.find("'{");
+    if (begin == std::string::npos)
+      return 1;
+
+    size_t end = _statement.find("}'", begin);
+    std::string items = _statement.substr(begin + 2, end - begin - 2);
+    if (items.empty())
+      return 0;
+
+    size_t count = 1;
+    for (size_t i = 0; i < items.length(); ++i)
+      if (items[i] == ',')
+        ++count;
+
+    return count;
+  }
+}
+
+//------------------------------------------------------------------------------
+// PgWireServer::Faults
+//------------------------------------------------------------------------------
+PgWireServer::Faults::Faults()
+  : latency(0),
+  stallRate(0),
+  stallTime(0),
+  errorRate(0),
+  dropRate(0),
+  seed(1)
+{
+
+}
+
+//------------------------------------------------------------------------------
+// PgWireServer
+//------------------------------------------------------------------------------
+PgWireServer::PgWireServer(uint64_t _firstId)
+  : m_listenFd(-1),
+  m_port(0),
+  m_firstId(_firstId),
+  m_random(1),
+  m_connections(0),
+  m_queries(0)
+{
+  pthread_mutex_init(&m_mutex, NULL);
+
+  if (pipe(m_wakeFds) != 0)
+    throw std::runtime_error("pgwire: unable to create wake pipe");
+
+  m_listenFd = socket(AF_INET, SOCK_STREAM, 0);
+
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+
+  socklen_t length = sizeof(address);
+  if (m_listenFd < 0 || bind(m_listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(m_listenFd, 16) != 0 || getsockname(m_listenFd, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+    throw std::runtime_error("pgwire: unable to listen on loopback");
+
+  m_port = ntohs(address.sin_port);
+
+  if (pthread_create(&m_thread, NULL, &PgWireServer::Run, this) != 0)
+    throw std::runtime_error("pgwire: unable to start server thread");
+}
+
+//------------------------------------------------------------------------------
+PgWireServer::~PgWireServer()
+{
+  char wake = 0;
+  if (write(m_wakeFds[1], &wake, 1) == 1)
+    pthread_join(m_thread, NULL);
+
+  for (size_t i = 0; i < m_clients.size(); ++i)
+    close(m_clients[i].fd);
+
+  close(m_listenFd);
+  close(m_wakeFds[0]);
+  close(m_wakeFds[1]);
+  pthread_mutex_destroy(&m_mutex);
+}
+
+//------------------------------------------------------------------------------
+std::string PgWireServer::GetPortString() const
+{
+  char buffer[8];
+  snprintf(buffer, sizeof(buffer), "%hu", m_port);
+  return buffer;
+}
+
+//------------------------------------------------------------------------------
+void PgWireServer::SetFaults(const Faults& _faults)
+{
+  pthread_mutex_lock(&m_mutex);
+  m_faults = _faults;
+  m_random = _faults.seed ? _faults.seed : 1;
+  pthread_mutex_unlock(&m_mutex);
+}
+
+//------------------------------------------------------------------------------
+std::vector<std::string> PgWireServer::GetStatements()
+{
+  pthread_mutex_lock(&m_mutex);
+  std::vector<std::string> statements = m_statements;
+  pthread_mutex_unlock(&m_mutex);
+
+  return statements;
+}
+
+//------------------------------------------------------------------------------
+size_t PgWireServer::CountStatements(const std::string& _prefix)
+{
+  size_t count = 0;
+
+  pthread_mutex_lock(&m_mutex);
+  for (size_t i = 0; i < m_statements.size(); ++i)
+    if (m_statements[i].compare(0, _prefix.length(), _prefix) == 0)
+      ++count;
+  pthread_mutex_unlock(&m_mutex);
+
+  return count;
+}
+
+//------------------------------------------------------------------------------
+void PgWireServer::ClearStatements()
+{
+  pthread_mutex_lock(&m_mutex);
+  m_statements.clear();
+  pthread_mutex_unlock(&m_mutex);
+}
+
+//------------------------------------------------------------------------------
+unsigned long PgWireServer::GetConnectionCount()
+{
+  pthread_mutex_lock(&m_mutex);
+  unsigned long connections = m_connections;
+  pthread_mutex_unlock(&m_mutex);
+
+  return connections;
+}
+
+//------------------------------------------------------------------------------
+unsigned long PgWireServer::GetQueryCount()
+{
+  pthread_mutex_lock(&m_mutex);
+  unsigned long queries = m_queries;
+  pthread_mutex_unlock(&m_mutex);
+
+  return queries;
+}
+
+//------------------------------------------------------------------------------
+void* PgWireServer::Run(void* _pServer)
+{
+  static_cast<PgWireServer*>(_pServer)->Serve();
+  return NULL;
+}
+
+//------------------------------------------------------------------------------
+void PgWireServer::Serve()
+{
+  for (;;)
+  {
+    std::vector<pollfd> fds;
+    pollfd wake = { m_wakeFds[0], POLLIN, 0 };
+    pollfd listener = { m_listenFd, POLLIN, 0 };
+    fds.push_back(wake);
+    fds.push_back(listener);
+    for (size_t i = 0; i < m_clients.size(); ++i)
+    {
+      pollfd client = { m_clients[i].fd, POLLIN, 0 };
+      fds.push_back(client);
+    }
+
+    if (poll(&fds[0], fds.size(), -1) < 0)
+      continue;
+
+    if (fds[0].revents)
+      return;
+
+    // Clients are served in order; one connection at a time is all the modules use
+    std::vector<Client> clients;
+    for (size_t i = 0; i < m_clients.size(); ++i)
+    {
+      if (fds[i + 2].revents && !Receive(m_clients[i]))
+        close(m_clients[i].fd);
+      else
+        clients.push_back(m_clients[i]);
+    }
+    m_clients.swap(clients);
+
+    if (fds[1].revents)
+    {
+      int fd = accept(m_listenFd, NULL, NULL);
+      if (fd < 0)
+        continue;
+
+      int noDelay = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+      Client client;
+      client.fd = fd;
+      client.isStarted = false;
+      m_clients.push_back(client);
+
+      pthread_mutex_lock(&m_mutex);
+      ++m_connections;
+      pthread_mutex_unlock(&m_mutex);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+bool PgWireServer::Receive(Client& _client)
+{
+  char buffer[65536];
+  ssize_t length = recv(_client.fd, buffer, sizeof(buffer), 0);
+  if (length <= 0)
+    return false;
+
+  _client.buffer.append(buffer, length);
+
+  for (;;)
+  {
+    // The startup packet has no type byte
+    size_t header = _client.isStarted ? 5 : 4;
+    if (_client.buffer.length() < header)
+      return true;
+
+    size_t messageLength = GetInt32(_client.buffer, header - 4) + header - 4;
+    if (_client.buffer.length() < messageLength)
+      return true;
+
+    char type = _client.isStarted ? _client.buffer[0] : 0;
+    std::string payload = _client.buffer.substr(header, messageLength - header);
+    _client.buffer.erase(0, messageLength);
+
+    if (!Answer(_client, type, payload))
+      return false;
+  }
+}
+
+//------------------------------------------------------------------------------
+bool PgWireServer::Answer(Client& _client, char _type, const std::string& _payload)
+{
+  switch (_type)
+  {
+  case 0:
+    return Startup(_client, _payload);
+
+  case 'Q':
+    return Query(_client, _payload.substr(0, _payload.find('\0')));
+
+  case 'X':
+    return false;
+
+  default:
+    return Send(_client.fd, ErrorResponse("0A000", "only the simple query protocol is supported") + Message('Z', "I"));
+  }
+}
+
+//------------------------------------------------------------------------------
+bool PgWireServer::Startup(Client& _client, const std::string& _payload)
+{
+  if (_payload.length() < 4)
+    return false;
+
+  uint32_t code = GetInt32(_payload, 0);
+
+  // Encryption is declined, libpq then continues in plain text
+  if (code == SSL_REQUEST || code == GSS_REQUEST)
+    return Send(_client.fd, "N");
+
+  if (code != PROTOCOL_VERSION)
+    return false;
+
+  std::string response;
+  std::string authentication;
+  PutInt32(authentication, 0);
+  response += Message('R', authentication);
+
+  response += ParameterStatus("server_version", "15.0");
+  response += ParameterStatus("server_encoding", "UTF8");
+  response += ParameterStatus("client_encoding", "UTF8");
+  response += ParameterStatus("standard_conforming_strings", "on");
+  response += ParameterStatus("integer_datetimes", "on");
+  response += ParameterStatus("DateStyle", "ISO, MDY");
+
+  std::string key;
+  PutInt32(key, getpid());
+  PutInt32(key, _client.fd);
+  response += Message('K', key);
+  response += Message('Z', "I");
+
+  _client.isStarted = true;
+  return Send(_client.fd, response);
+}
+
+//------------------------------------------------------------------------------
+bool PgWireServer::Query(Client& _client, const std::string& _query)
+{
+  std::vector<std::string> statements = SplitStatements(_query);
+
+  pthread_mutex_lock(&m_mutex);
+  ++m_queries;
+  m_statements.insert(m_statements.end(), statements.begin(), statements.end());
+
+  bool isFaulted = m_faults.match.empty() || _query.find(m_faults.match) != std::string::npos;
+  bool isDropped = isFaulted && Roll(m_faults.dropRate);
+  bool isError = isFaulted && Roll(m_faults.errorRate);
+  bool isStalled = isFaulted && Roll(m_faults.stallRate);
+  unsigned int latency = isFaulted ? m_faults.latency : 0;
+  unsigned int stallTime = m_faults.stallTime;
+  pthread_mutex_unlock(&m_mutex);
+
+  if (isDropped)
+    return false;
+
+  if (latency)
+    usleep(latency * 1000);
+
+  std::string response;
+  if (isError)
+    response += ErrorResponse("XX000", "injected fault");
+  else if (statements.empty())
+    response += Message('I', "");
+  else
+  {
+    pthread_mutex_lock(&m_mutex);
+    for (size_t i = 0; i < statements.size() && Execute(statements[i], response); ++i)
+      ;
+    pthread_mutex_unlock(&m_mutex);
+  }
+  response += Message('Z', "I");
+
+  // A stalled answer leaves the client holding half a message
+  if (isStalled && stallTime)
+  {
+    size_t half = response.length() / 2;
+    if (!Send(_client.fd, response.substr(0, half)))
+      return false;
+
+    usleep(stallTime * 1000);
+    return Send(_client.fd, response.substr(half));
+  }
+
+  return Send(_client.fd, response);
+}
+
+//------------------------------------------------------------------------------
+bool PgWireServer::Execute(const std::string& _statement, std::string& _response)
+{
+  std::string keyword = _statement.substr(0, _statement.find(' '));
+  for (size_t i = 0; i < keyword.length(); ++i)
+    keyword[i] = toupper(static_cast<unsigned char>(keyword[i]));
+
+  std::string tableName = FirstIdentifier(_statement);
+  bool isKnown = m_tables.count(tableName) && m_tables[tableName].isCreated;
+  char tag[64];
+
+  if (keyword == "CREATE")
+  {
+    Table& table = m_tables[tableName];
+    if (!table.isCreated)
+    {
+      table.isCreated = true;
+      table.sequence = m_firstId;
+    }
+
+    _response += CommandComplete("CREATE TABLE");
+  }
+  else if (keyword == "SELECT" && _statement.find("nextval") != std::string::npos)
+  {
+    if (!isKnown)
+    {
+      _response += ErrorResponse("42P01", "relation \"" + tableName + "\" does not exist");
+      return false;
+    }
+
+    size_t position = _statement.find("generate_series(1,");
+    unsigned long count = position == std::string::npos ? 1 : strtoul(_statement.c_str() + position + 18, NULL, 10);
+
+    _response += RowDescription("nextval", INT8OID);
+    for (unsigned long i = 0; i < count; ++i)
+    {
+      snprintf(tag, sizeof(tag), "%llu", static_cast<unsigned long long>(m_tables[tableName].sequence++));
+      _response += DataRow(tag);
+    }
+
+    snprintf(tag, sizeof(tag), "SELECT %lu", count);
+    _response += CommandComplete(tag);
+  }
+  else if (keyword == "SELECT")
+  {
+    _response += RowDescription("?column?", TEXTOID);
+    _response += CommandComplete("SELECT 0");
+  }
+  else if (keyword == "INSERT")
+  {
+    if (!isKnown)
+    {
+      _response += ErrorResponse("42P01", "relation \"" + tableName + "\" does not exist");
+      return false;
+    }
+
+    size_t rows = CountValueRows(_statement);
+
+    // Rows without an explicit id take the next value of the table's sequence
+    if (_statement.find("RETURNING") != std::string::npos)
+    {
+      _response += RowDescription("id", INT4OID);
+      for (size_t i = 0; i < rows; ++i)
+      {
+        snprintf(tag, sizeof(tag), "%llu", static_cast<unsigned long long>(m_tables[tableName].sequence++));
+        _response += DataRow(tag);
+      }
+    }
+
+    snprintf(tag, sizeof(tag), "INSERT 0 %lu", static_cast<unsigned long>(rows));
+    _response += CommandComplete(tag);
+  }
+  else if (keyword == "UPDATE")
+  {
+    size_t rows = _statement.find("FROM (VALUES") != std::string::npos ? CountValueRows(_statement) : 1;
+    snprintf(tag, sizeof(tag), "UPDATE %lu", static_cast<unsigned long>(isKnown ? rows : 0));
+    _response += CommandComplete(tag);
+  }
+  else if (keyword == "DELETE")
+  {
+    snprintf(tag, sizeof(tag), "DELETE %lu", static_cast<unsigned long>(isKnown ? CountArrayItems(_statement) : 0));
+    _response += CommandComplete(tag);
+  }
+  else if (keyword == "EXPLAIN")
+  {
+    _response += RowDescription("QUERY PLAN", TEXTOID);
+    _response += DataRow("Result  (cost=0.00..0.01 rows=1 width=0)");
+    _response += CommandComplete("EXPLAIN");
+  }
+  else
+    _response += CommandComplete(keyword);
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool PgWireServer::Roll(unsigned int _percent)
+{
+  if (_percent == 0)
+    return false;
+
+  // xorshift32, so a seed always produces the same faults
+  m_random ^= m_random << 13;
+  m_random ^= m_random >> 17;
+  m_random ^= m_random << 5;
+
+  return m_random % 100 < _percent;
+}
+
+//------------------------------------------------------------------------------
+bool PgWireServer::Send(int _fd, const std::string& _data)
+{
+  for (size_t sent = 0; sent < _data.length();)
+  {
+    ssize_t length = send(_fd, _data.data() + sent, _data.length() - sent, MSG_NOSIGNAL);
+    if (length <= 0)
+      return false;
+    sent += length;
+  }
+
+  return true;
+}
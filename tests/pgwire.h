@@ -0,0 +1,84 @@
+//==============================================================================
+// File:	pgwire.h
+// Purpose: In-process PostgreSQL wire protocol stand-in with fault injection
+//==============================================================================
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+//------------------------------------------------------------------------------
+// PgWireServer - answers the statements the modules send, on a loopback port
+//------------------------------------------------------------------------------
+class PgWireServer
+{
+ public:
+  struct Faults
+  {
+    unsigned int latency;     // ms before each answer
+    unsigned int stallRate;   // percent of answers that stop halfway through
+    unsigned int stallTime;   // ms a stalled answer waits before the rest is sent
+    unsigned int errorRate;   // percent of queries answered with an ErrorResponse
+    unsigned int dropRate;    // percent of queries that close the connection instead
+    std::string match;        // faults only apply to queries containing this, empty for all
+    unsigned int seed;        // same seed, same faults for the same sequence of queries
+
+    Faults();
+  };
+
+ private:
+  struct Client
+  {
+    int fd;
+    bool isStarted;
+    std::string buffer;
+  };
+
+  struct Table
+  {
+    bool isCreated;
+    uint64_t sequence;
+  };
+
+  int m_listenFd;
+  int m_wakeFds[2];
+  unsigned short m_port;
+  pthread_t m_thread;
+  pthread_mutex_t m_mutex;
+
+  uint64_t m_firstId;
+  Faults m_faults;
+  uint32_t m_random;
+  std::vector<Client> m_clients;
+  std::map<std::string, Table> m_tables;
+  std::vector<std::string> m_statements;
+  unsigned long m_connections;
+  unsigned long m_queries;
+
+  static void* Run(void* _pServer);
+  void Serve();
+  bool Receive(Client& _client);
+  bool Answer(Client& _client, char _type, const std::string& _payload);
+  bool Startup(Client& _client, const std::string& _payload);
+  bool Query(Client& _client, const std::string& _query);
+  bool Execute(const std::string& _statement, std::string& _response);
+  bool Roll(unsigned int _percent);
+  bool Send(int _fd, const std::string& _data);
+
+ public:
+  PgWireServer(uint64_t _firstId = 1);
+  ~PgWireServer();
+
+  unsigned short GetPort() const { return m_port; }
+  std::string GetPortString() const;
+
+  void SetFaults(const Faults& _faults);
+  std::vector<std::string> GetStatements();
+  size_t CountStatements(const std::string& _prefix);
+  void ClearStatements();
+  unsigned long GetConnectionCount();
+  unsigned long GetQueryCount();
+};
@@ -0,0 +1,133 @@
+//==============================================================================
+// File:	test.h
+// Purpose: Checks, a serializable test type and a module environment wired to
+//          the wire protocol stand-in
+//==============================================================================
+#pragma once
+
+#include "module.h"
+#include "m_pgsql.h"
+#include "pgwire.h"
+
+#include <cstdio>
+
+//------------------------------------------------------------------------------
+// Checks
+//------------------------------------------------------------------------------
+#define CHECK(_condition) Test::Check((_condition), #_condition, __FILE__, __LINE__)
+#define RUN(_case) Test::Run(#_case, &_case)
+
+namespace Test
+{
+  inline unsigned int& GetFailures()
+  {
+    static unsigned int failures = 0;
+    return failures;
+  }
+
+  inline bool Check(bool _isPassed, const char* _pExpression, const char* _pFile, int _line)
+  {
+    if (!_isPassed)
+    {
+      fprintf(stderr, "%s:%d: check failed: %s\n", _pFile, _line, _pExpression);
+      ++GetFailures();
+    }
+
+    return _isPassed;
+  }
+
+  inline void Run(const char* _pName, void (*_pCase)())
+  {
+    unsigned int failures = GetFailures();
+    double startTime = Datastore::GetTime();
+
+    _pCase();
+
+    printf("%-40s %s (%.0fms)\n", _pName, failures == GetFailures() ? "ok" : "FAILED", Datastore::GetTime() - startTime);
+  }
+
+  inline int Summary()
+  {
+    printf("%u failed checks\n", GetFailures());
+    return GetFailures() ? 1 : 0;
+  }
+
+  // Percentile of a set of measured times, in milliseconds
+  inline double Percentile(std::vector<double> _times, double _percentile)
+  {
+    if (_times.empty())
+      return 0;
+
+    std::sort(_times.begin(), _times.end());
+    return _times[static_cast<size_t>((_times.size() - 1) * _percentile / 100.0)];
+  }
+}
+
+//------------------------------------------------------------------------------
+// TestRecord
+//------------------------------------------------------------------------------
+class TestRecord : public Serializable
+{
+ public:
+  Anope::string nick;
+  Anope::string lastSeen;
+  unsigned int flags;
+
+  TestRecord(const Anope::string& _nick)
+    : Serializable("TestRecord"),
+    nick(_nick),
+    lastSeen("never"),
+    flags(0)
+  {
+
+  }
+
+  void Serialize(Serialize::Data& _data) const anope_override
+  {
+    _data["nick"] << nick;
+    _data["last_seen"] << lastSeen;
+    _data.SetType("flags", Serialize::Data::DT_INT);
+    _data["flags"] << flags;
+  }
+};
+
+//------------------------------------------------------------------------------
+// PgSQLEnvironment - m_pgsql loaded and configured against a stand-in server
+//------------------------------------------------------------------------------
+class PgSQLEnvironment
+{
+ public:
+  PgWireServer server;
+  Serialize::Type type;
+  Configuration::Conf config;
+  PgSQLModule* pModule;
+
+  PgSQLEnvironment(unsigned int _stallBudget = 100)
+    : type("TestRecord"),
+    pModule(NULL)
+  {
+    Configuration::Block& block = config.GetModule("m_pgsql").AddBlock("pgsql");
+    block.Set("name", "pgsql/main").Set("server", "127.0.0.1").Set("port", server.GetPortString());
+    block.Set("stallbudget", stringify(_stallBudget));
+
+    pModule = new PgSQLModule("m_pgsql", "test");
+    pModule->OnReload(&config);
+  }
+
+  ~PgSQLEnvironment()
+  {
+    delete pModule;
+  }
+
+  // Points the connection at another server, as a rehash with a changed block would
+  void Reload(const PgWireServer& _server)
+  {
+    config.GetModule("m_pgsql").GetBlock("pgsql", 0)->Set("port", _server.GetPortString());
+    pModule->OnReload(&config);
+  }
+
+  PgSQLConnection* GetConnection()
+  {
+    return dynamic_cast<PgSQLConnection*>(Service::FindService("Datastore::Provider", "pgsql/main"));
+  }
+};